@@ -0,0 +1,100 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include "arena.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+void* Arena::AllocateSlow(const std::size_t size, const std::size_t align) {
+	// Move on to the next block that can hold the request, or add one
+	if (current < blocks.size()) {
+		previousBytes += offset;
+		current++;
+	}
+	while (current < blocks.size() && blocks[current].size < size + align) current++;
+	if (current == blocks.size()) {
+		std::size_t blockSize = MIN_BLOCK_SIZE;
+		if (size + align > blockSize) blockSize = size + align;
+		blocks.push_back({ std::unique_ptr<char[]>(new char[blockSize]), blockSize });
+		current = blocks.size() - 1;
+	}
+	offset = 0;
+	return Allocate(size, align);
+}
+
+void Arena::Reset() {
+	highWater = std::max(highWater, GetUsed());
+	// Merge the blocks of a frame that outgrew the first one
+	if (current > 0 && current < blocks.size()) {
+		std::size_t total = 0;
+		for (const Block& block : blocks) total += block.size;
+		blocks.clear();
+		blocks.push_back({ std::unique_ptr<char[]>(new char[total]), total });
+	}
+	current = 0;
+	offset = 0;
+	previousBytes = 0;
+}
+
+std::size_t Arena::GetUsed() const {
+	return previousBytes + offset;
+}
+
+std::size_t Arena::GetHighWater() const {
+	return std::max(highWater, GetUsed());
+}
+
+std::size_t Arena::GetCapacity() const {
+	std::size_t total = 0;
+	for (const Block& block : blocks) total += block.size;
+	return total;
+}
+
+FrameArena::FrameArena() {
+	Reset();
+}
+
+void FrameArena::ReserveTeam() {
+#ifdef _OPENMP
+	int threads = omp_get_num_threads();
+	if ((int)threadArenas.size() < threads) threadArenas.resize(threads);
+#endif
+}
+
+Arena& FrameArena::GetThreadArena() {
+#ifdef _OPENMP
+	int thread = omp_get_thread_num();
+	if (omp_get_level() > 1 || thread >= (int)threadArenas.size()) {
+		std::cerr << "error: no frame arena for thread " << thread << " at parallel level " << omp_get_level() << std::endl;
+		std::abort();
+	}
+	return threadArenas[thread].arena;
+#else
+	return threadArenas[0].arena;
+#endif
+}
+
+void FrameArena::Reset() {
+	mainArena.Reset();
+#ifdef _OPENMP
+	int threads = omp_get_max_threads();
+#else
+	int threads = 1;
+#endif
+	if ((int)threadArenas.size() < threads) threadArenas.resize(threads);
+	for (ThreadArena& thread : threadArenas) thread.arena.Reset();
+}
+
+std::size_t FrameArena::GetHighWater() const {
+	std::size_t total = mainArena.GetHighWater();
+	for (const ThreadArena& thread : threadArenas) total += thread.arena.GetHighWater();
+	return total;
+}
+
+std::size_t FrameArena::GetCapacity() const {
+	std::size_t total = mainArena.GetCapacity();
+	for (const ThreadArena& thread : threadArenas) total += thread.arena.GetCapacity();
+	return total;
+}
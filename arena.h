@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Bump allocator for data that lives until the end of the frame. Nothing is freed on its own,
+// Reset drops everything at once and keeps the memory for the next frame. It is O(1) while the
+// frames fit the first block; after a frame that needed more blocks, Reset frees them and
+// allocates one block of their total size, so frames within the high-water mark stop touching
+// the heap
+class Arena {
+	static const std::size_t MIN_BLOCK_SIZE = 1 << 20;
+
+	struct Block {
+		std::unique_ptr<char[]> data;
+		std::size_t size;
+	};
+	std::vector<Block> blocks;
+	// Block being filled, and the bytes used in it and in the blocks before it this frame
+	std::size_t current = 0;
+	std::size_t offset = 0;
+	std::size_t previousBytes = 0;
+	std::size_t highWater = 0;
+
+	void* AllocateSlow(const std::size_t size, const std::size_t align);
+
+public :
+	Arena() = default;
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+	Arena(Arena&&) = default;
+	Arena& operator=(Arena&&) = default;
+
+	void* Allocate(const std::size_t size, const std::size_t align) {
+		if (current < blocks.size()) {
+			char* base = blocks[current].data.get();
+			std::size_t start = ((reinterpret_cast<std::uintptr_t>(base) + offset + align - 1) & ~(std::uintptr_t)(align - 1)) - reinterpret_cast<std::uintptr_t>(base);
+			if (start + size <= blocks[current].size) {
+				offset = start + size;
+				return base + start;
+			}
+		}
+		return AllocateSlow(size, align);
+	}
+	// Uninitialized storage for count objects of a trivially destructible type
+	template<typename T> T* Allocate(const std::size_t count) {
+		return static_cast<T*>(Allocate(count * sizeof(T), alignof(T)));
+	}
+	// Construct a T in the arena. A T with a destructor has to be destroyed before the next
+	// Reset, e.g. by holding it in a std::unique_ptr<T, ArenaDelete>
+	template<typename T, typename... Args> T* New(Args&&... args) {
+		return new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+	}
+	// Shrink the latest allocation to its first count objects, returning the rest to the arena
+	template<typename T> void Trim(T* last, const std::size_t count) {
+		offset = reinterpret_cast<char*>(last + count) - blocks[current].data.get();
+	}
+
+	void Reset();
+	// Bytes handed out so far this frame, and at most in any frame
+	std::size_t GetUsed() const;
+	std::size_t GetHighWater() const;
+	// Bytes held from the heap
+	std::size_t GetCapacity() const;
+};
+
+// Deleter for arena objects: runs the destructor, the memory goes with the next Reset
+struct ArenaDelete {
+	template<typename T> void operator()(T* object) const {
+		object->~T();
+	}
+};
+
+// The arenas of a frame: one for the thread driving it and one per OpenMP thread, so the
+// parallel stages allocate without locking
+class FrameArena {
+	// Padded to a cache line, neighbouring threads bump their offsets without false sharing
+	struct alignas(64) ThreadArena {
+		Arena arena;
+	};
+	Arena mainArena;
+	std::vector<ThreadArena> threadArenas;
+
+public :
+	FrameArena();
+
+	Arena& Get() { return mainArena; }
+	// Give every thread of the calling parallel region its own sub-arena. Called by a single
+	// thread of the region, before the others allocate
+	void ReserveTeam();
+	// Sub-arena of the calling thread inside an OpenMP parallel region. Aborts for a thread that
+	// has none, or inside a nested region, where threads of different teams share a number
+	Arena& GetThreadArena();
+
+	// Reset every arena, sized for the current OpenMP thread count
+	void Reset();
+	std::size_t GetHighWater() const;
+	std::size_t GetCapacity() const;
+};
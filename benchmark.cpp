@@ -0,0 +1,431 @@
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include "benchmark.h"
+#include "camera.h"
+#include "cpu.h"
+#include "light.h"
+#include "model.h"
+#include "renderer.h"
+#include "shader.h"
+#include "shadowmap.h"
+#include "tgaimage.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+typedef std::chrono::steady_clock Clock;
+
+static const int MIN_ITERATIONS = 3;
+
+// Results of the benchmarked bodies are folded into this so the compiler can't drop them
+static volatile float benchmarkSink;
+
+struct BenchmarkResult {
+	std::string name;
+	// Parameters as JSON values
+	std::vector<std::pair<std::string, std::string>> params;
+	// Seconds per iteration
+	std::vector<double> times;
+	// Work done per iteration, in unit
+	long long items;
+	std::string unit;
+	// Pipeline counters of the last iteration
+	std::vector<std::pair<std::string, long long>> counters;
+};
+
+static std::string JsonString(const std::string& str) {
+	std::string out = "\"";
+	for (char c : str) {
+		if (c == '"' || c == '\\') out += '\\';
+		if ((unsigned char)c < 0x20) out += ' ';
+		else out += c;
+	}
+	return out + "\"";
+}
+
+static std::string JsonNumber(const double value) {
+	std::ostringstream out;
+	out.precision(6);
+	out << value;
+	return out.str();
+}
+
+static int GetMaxThreads() {
+#ifdef _OPENMP
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+static void SetThreads(const int threads) {
+#ifdef _OPENMP
+	omp_set_num_threads(threads);
+#else
+	(void)threads;
+#endif
+}
+
+static const char* GetSimdName(const SimdLevel level) {
+	switch (level) {
+	case SimdLevel::AVX2: return "avx2";
+	case SimdLevel::SSE2: return "sse2";
+	default: return "scalar";
+	}
+}
+
+// Silences std::cerr while alive, the loaders report every file they read
+class QuietErrors {
+	std::streambuf* saved;
+public :
+	QuietErrors() : saved(std::cerr.rdbuf(nullptr)) {}
+	~QuietErrors() { std::cerr.rdbuf(saved); }
+};
+
+class Benchmarks {
+	const BenchmarkOptions& options;
+	std::vector<int> threadCounts;
+	std::vector<BenchmarkResult> results;
+	std::map<std::string, std::unique_ptr<Model>> models;
+
+public :
+	explicit Benchmarks(const BenchmarkOptions& options) : options(options) {
+		for (int n : options.threads) {
+			if (n > 0) threadCounts.push_back(n);
+		}
+		if (threadCounts.empty()) {
+			int maxThreads = GetMaxThreads();
+			for (int n = 1; n < maxThreads; n *= 2) threadCounts.push_back(n);
+			threadCounts.push_back(maxThreads);
+		}
+	}
+
+	const std::vector<int>& GetThreadCounts() const { return threadCounts; }
+
+	bool Selected(const std::string& name) const {
+		return name.find(options.filter) != std::string::npos;
+	}
+
+	std::string AssetPath(const std::string& asset) const {
+		return options.assetDir + "/" + asset;
+	}
+
+	// Models are loaded once and shared by every benchmark, nullptr when the file is missing
+	Model* GetModel(const std::string& asset) {
+		auto it = models.find(asset);
+		if (it != models.end()) return it->second.get();
+		std::unique_ptr<Model>& model = models[asset];
+		std::string path = AssetPath(asset);
+		if (std::ifstream(path).good()) model.reset(new Model(path));
+		else std::cerr << "error: benchmark asset " << path << " not found" << std::endl;
+		return model.get();
+	}
+
+	// Run body once to warm the caches, then repeatedly for at least minSeconds
+	template<typename F> void Run(BenchmarkResult result, F&& body) {
+		std::cerr << "# bench " << result.name;
+		for (const auto& param : result.params) std::cerr << " " << param.first << "=" << param.second;
+		std::cerr << std::endl;
+
+		body();
+		double total = 0;
+		while (total < options.minSeconds || (int)result.times.size() < MIN_ITERATIONS) {
+			auto start = Clock::now();
+			body();
+			double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+			result.times.push_back(seconds);
+			total += seconds;
+		}
+		results.push_back(std::move(result));
+	}
+
+	// Attach a counter to the benchmark that ran last
+	void AddCounter(const std::string& key, const long long value) {
+		assert(!results.empty());
+		results.back().counters.emplace_back(key, value);
+	}
+
+	void Write(std::ostream& out) const {
+		out << "{\n";
+		out << "  \"renderer\": \"QsRenderer\",\n";
+		out << "  \"simd\": " << JsonString(GetSimdName(DetectSimdLevel())) << ",\n";
+		out << "  \"max_threads\": " << GetMaxThreads() << ",\n";
+		out << "  \"min_seconds\": " << JsonNumber(options.minSeconds) << ",\n";
+		out << "  \"benchmarks\": [";
+		for (size_t i = 0; i < results.size(); i++) {
+			const BenchmarkResult& result = results[i];
+			std::vector<double> times = result.times;
+			std::sort(times.begin(), times.end());
+			double sum = 0, sumSq = 0;
+			for (double t : times) {
+				sum += t;
+				sumSq += t * t;
+			}
+			int n = (int)times.size();
+			double mean = sum / n;
+			double stddev = std::sqrt(std::max(sumSq / n - mean * mean, 0.));
+			double median = n % 2 ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2;
+
+			out << (i ? ",\n" : "\n") << "    { \"name\": " << JsonString(result.name) << ", \"params\": {";
+			for (size_t k = 0; k < result.params.size(); k++) {
+				out << (k ? ", " : " ") << JsonString(result.params[k].first) << ": " << result.params[k].second;
+			}
+			out << (result.params.empty() ? "}" : " }");
+			if (!result.counters.empty()) {
+				out << ", \"counters\": {";
+				for (size_t k = 0; k < result.counters.size(); k++) {
+					out << (k ? ", " : " ") << JsonString(result.counters[k].first) << ": " << result.counters[k].second;
+				}
+				out << " }";
+			}
+			out << ", \"iterations\": " << n;
+			out << ", \"mean_ms\": " << JsonNumber(mean * 1000);
+			out << ", \"median_ms\": " << JsonNumber(median * 1000);
+			out << ", \"min_ms\": " << JsonNumber(times.front() * 1000);
+			out << ", \"max_ms\": " << JsonNumber(times.back() * 1000);
+			out << ", \"stddev_ms\": " << JsonNumber(stddev * 1000);
+			out << ", \"items\": " << result.items << ", \"unit\": " << JsonString(result.unit);
+			out << ", \"items_per_second\": " << JsonNumber(result.items / median) << " }";
+		}
+		out << "\n  ]\n}\n";
+	}
+};
+
+static void BenchModelLoad(Benchmarks& bench) {
+	for (const char* asset : { "diablo3pose/diablo3pose.obj", "africanhead/africanhead.obj", "boggie/body.obj" }) {
+		std::string name = std::string("model_load/") + asset;
+		if (!bench.Selected(name)) continue;
+		Model* model = bench.GetModel(asset);
+		if (!model) continue;
+		std::string path = bench.AssetPath(asset);
+		for (int threads : bench.GetThreadCounts()) {
+			SetThreads(threads);
+			bench.Run({ name, { { "threads", std::to_string(threads) } }, {}, model->GetNumberOfFaces(), "faces", {} }, [&]() {
+				QuietErrors quiet;
+				Model loaded(path);
+				benchmarkSink = (float)loaded.GetNumberOfVertices();
+			});
+		}
+	}
+}
+
+static void BenchTgaRead(Benchmarks& bench) {
+	for (const char* asset : { "diablo3pose/diablo3pose_main.tga", "diablo3pose/diablo3pose_nm_tangent.tga", "africanhead/africanhead_main.tga" }) {
+		std::string name = std::string("tga_read/") + asset;
+		if (!bench.Selected(name)) continue;
+		std::string path = bench.AssetPath(asset);
+		TGAImage image;
+		if (!image.read_tga_file(path)) continue;
+		long long pixels = (long long)image.width() * image.height();
+		bench.Run({ name, {}, {}, pixels, "pixels", {} }, [&]() {
+			QuietErrors quiet;
+			TGAImage loaded;
+			loaded.read_tga_file(path);
+			benchmarkSink = (float)loaded.width();
+		});
+	}
+}
+
+// The stage benchmarks draw diablo3pose through the default camera at 800x800
+struct StageScene {
+	Camera camera{ vec3(0.8, 0.8, 2.4), vec3(0, 0, 0) };
+	Light light{ vec3(1, 1, 1) };
+	std::vector<Model*> models;
+	std::unique_ptr<Renderer> renderer;
+	std::vector<int> meshlets;
+
+	explicit StageScene(Model& model) : models{ &model } {
+		renderer.reset(new Renderer(camera, light, models, 800, 800));
+		for (int i = 0; i < model.GetNumberOfMeshlets(); i++) meshlets.push_back(i);
+	}
+};
+
+static void BenchVertexTransform(Benchmarks& bench, Model& model) {
+	std::string name = "vertex_transform/diablo3pose";
+	if (!bench.Selected(name)) return;
+	StageScene scene(model);
+	BlinnPhongShader shader(*scene.renderer, model);
+	for (int threads : bench.GetThreadCounts()) {
+		SetThreads(threads);
+		bench.Run({ name, { { "threads", std::to_string(threads) } }, {}, model.GetNumberOfVertices(), "vertices", {} }, [&]() {
+			shader.ProcessVertices(scene.meshlets);
+		});
+	}
+}
+
+static void BenchBarycentric(Benchmarks& bench, Model& model) {
+	std::string name = "barycentric";
+	if (!bench.Selected(name)) return;
+	StageScene scene(model);
+
+	// Random screen-space triangles of up to 64 pixels a side, and points in their bounding boxes
+	const int COUNT = 1 << 16;
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> position(0, 800), offset(-64, 64), unit(0, 1);
+	std::vector<vec2> tris(COUNT * 3), points(COUNT);
+	for (int i = 0; i < COUNT; i++) {
+		vec2 base(position(rng), position(rng));
+		for (int k = 0; k < 3; k++) tris[i * 3 + k] = base + vec2(offset(rng), offset(rng));
+		points[i] = base + vec2(offset(rng), offset(rng)) * unit(rng);
+	}
+
+	SetThreads(1);
+	bench.Run({ name, { { "threads", "1" } }, {}, COUNT, "calls", {} }, [&]() {
+		float sum = 0;
+		for (int i = 0; i < COUNT; i++) sum += scene.renderer->barycentric(&tris[i * 3], points[i]).x;
+		benchmarkSink = sum;
+	});
+}
+
+static void BenchDepthRaster(Benchmarks& bench, Model& model) {
+	std::string name = "raster_depth/diablo3pose";
+	if (!bench.Selected(name)) return;
+	mat<4, 4> identity = mat<4, 4>::identity();
+	vec3 center = (model.GetBoundsMin() + model.GetBoundsMax()) * 0.5f;
+	float radius = (model.GetBoundsMax() - center).norm();
+	for (int size : { 1024, 2048 }) {
+		ShadowMap shadowMap(size);
+		for (int threads : bench.GetThreadCounts()) {
+			SetThreads(threads);
+			bench.Run({ name, { { "size", std::to_string(size) }, { "threads", std::to_string(threads) } }, {}, model.GetNumberOfFaces(), "faces", {} }, [&]() {
+				shadowMap.Begin(vec3(1, 1, 1).normalize(), center, radius);
+				shadowMap.Draw(model, identity);
+			});
+		}
+	}
+}
+
+// Fragment stage alone over every face of the model, at four points per face
+template<typename ShaderT> static void BenchFragment(Benchmarks& bench, Model& model, const std::string& shaderName) {
+	std::string name = "fragment/" + shaderName + "/diablo3pose";
+	if (!bench.Selected(name)) return;
+	StageScene scene(model);
+	ShaderT shader(*scene.renderer, model);
+	shader.ProcessVertices(scene.meshlets);
+
+	std::vector<Shader::Varyings> varyings(model.GetNumberOfFaces());
+	for (int i = 0; i < model.GetNumberOfFaces(); i++) {
+		vec4 clipPos[3];
+		shader.AssembleFace(i, clipPos, varyings[i]);
+	}
+	const vec3 bars[4] = { vec3(1, 1, 1) / 3.f, vec3(0.6, 0.2, 0.2), vec3(0.2, 0.6, 0.2), vec3(0.2, 0.2, 0.6) };
+	const vec3 barDx(0.01, -0.01, 0), barDy(0, 0.01, -0.01);
+
+	SetThreads(1);
+	bench.Run({ name, { { "threads", "1" } }, {}, (long long)varyings.size() * 4, "fragments", {} }, [&]() {
+		float sum = 0;
+		vec3 color;
+		for (const Shader::Varyings& v : varyings) {
+			for (const vec3& bar : bars) {
+				shader.fragment(v, bar, barDx, barDy, color);
+				sum += color.x;
+			}
+		}
+		benchmarkSink = sum;
+	});
+}
+
+// Full frames, from the texture preload to the 8-bit image, without writing it
+struct SceneDesc {
+	const char* name;
+	std::vector<const char*> assets;
+	const char* shader;
+	bool shadows;
+	// Instances on a grid x grid square, 0 to draw each model once
+	int grid;
+};
+
+static void BenchScenes(Benchmarks& bench) {
+	const SceneDesc scenes[] = {
+		{ "africanhead", { "africanhead/africanhead.obj", "africanhead/africanheadeyeinner.obj", "africanhead/africanheadeyeouter.obj" }, "bump", false, 0 },
+		{ "diablo3pose", { "diablo3pose/diablo3pose.obj" }, "bump", false, 0 },
+		{ "boggie", { "boggie/body.obj", "boggie/head.obj", "boggie/eyes.obj" }, "bump", false, 0 },
+		{ "diablo3pose_floor", { "floor/floor.obj", "diablo3pose/diablo3pose.obj" }, "bump", true, 0 },
+		{ "diablo3pose_crowd", { "diablo3pose/diablo3pose.obj" }, "bump", false, 7 },
+	};
+	const int resolutions[][2] = { { 400, 400 }, { 800, 800 }, { 1920, 1080 } };
+
+	for (const SceneDesc& desc : scenes) {
+		std::string name = std::string("frame/") + desc.name;
+		if (!bench.Selected(name)) continue;
+		std::vector<Model*> models;
+		for (const char* asset : desc.assets) {
+			Model* model = bench.GetModel(asset);
+			if (model) models.push_back(model);
+		}
+		if (models.size() != desc.assets.size()) continue;
+
+		// Shrunk, turned copies on a square in front of a camera pulled back to see them all
+		std::vector<Model::Transform> instances;
+		for (int i = 0; i < desc.grid * desc.grid; i++) {
+			Model::Transform transform;
+			transform.position = vec3(i % desc.grid - (desc.grid - 1) / 2.f, 0, i / desc.grid - (desc.grid - 1) / 2.f) * 0.9f;
+			transform.rotation = vec3(0, i * 137.5f, 0);
+			transform.scale = vec3(0.45f, 0.45f, 0.45f);
+			instances.push_back(transform);
+		}
+		for (Model* model : models) model->SetInstances(instances);
+		vec3 eye = desc.grid ? vec3(0, 4, 7) : vec3(0.8, 0.8, 2.4);
+
+		for (const auto& resolution : resolutions) {
+			int width = resolution[0], height = resolution[1];
+			Camera camera(eye, vec3(0, 0, 0), 45, (float)width / height, 0.1f, 50);
+			Light light(vec3(1, 1, 1));
+			Renderer renderer(camera, light, models, width, height);
+			for (Model* model : models) renderer.SetModelShader(*model, desc.shader);
+			if (desc.shadows) renderer.SetShadows(true);
+
+			for (int threads : bench.GetThreadCounts()) {
+				SetThreads(threads);
+				BenchmarkResult result = { name, {
+					{ "width", std::to_string(width) },
+					{ "height", std::to_string(height) },
+					{ "threads", std::to_string(threads) },
+					{ "shader", JsonString(desc.shader) },
+					{ "shadows", desc.shadows ? "true" : "false" },
+					{ "instances", std::to_string(models[0]->GetNumberOfInstances()) } }, {}, 1, "frames", {} };
+				bench.Run(result, [&]() {
+					renderer.RenderFrame();
+					benchmarkSink = (float)renderer.ResolveImage().data[0];
+				});
+				const RenderStats& stats = renderer.GetStats();
+				bench.AddCounter("faces_submitted", stats.facesSubmitted);
+				bench.AddCounter("triangles_rasterized", stats.trianglesRasterized);
+				bench.AddCounter("hiz_culled", stats.hiZCulled);
+				bench.AddCounter("arena_high_water", (long long)renderer.GetFrameArena().GetHighWater());
+			}
+		}
+		// The models are shared with the other benchmarks
+		for (Model* model : models) model->SetInstances({});
+	}
+}
+
+bool RunBenchmarks(const BenchmarkOptions& options, std::ostream& out) {
+	int maxThreads = GetMaxThreads();
+	Benchmarks bench(options);
+
+	Model* diablo = bench.GetModel("diablo3pose/diablo3pose.obj");
+	if (!diablo) return false;
+
+	BenchModelLoad(bench);
+	BenchTgaRead(bench);
+	BenchVertexTransform(bench, *diablo);
+	BenchBarycentric(bench, *diablo);
+	BenchDepthRaster(bench, *diablo);
+	BenchFragment<BlinnPhongShader>(bench, *diablo, "blinnphong");
+	BenchFragment<BumpShader>(bench, *diablo, "bump");
+	BenchScenes(bench);
+
+	SetThreads(maxThreads);
+	bench.Write(out);
+	return true;
+}
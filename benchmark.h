@@ -0,0 +1,23 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Benchmarks of the pipeline stages in isolation (obj parsing, tga decoding, vertex transform,
+// barycentrics, depth rasterization, the fragment stage of each shader) and of full frames of the
+// bundled scenes over several resolutions and thread counts
+struct BenchmarkOptions {
+	// Directory holding africanhead, boggie, diablo3pose and floor
+	std::string assetDir = "obj";
+	// Only benchmarks whose name contains filter are run
+	std::string filter;
+	// Each benchmark repeats until it has run this long, and at least a few times
+	double minSeconds = 0.5;
+	// Thread counts of the multithreaded benchmarks, empty for 1, 2, 4 ... up to all cores
+	std::vector<int> threads;
+};
+
+// Run the benchmarks and write the results to out as one JSON document, returns false when
+// an asset is missing. Progress and the loaders' messages go to std::cerr
+bool RunBenchmarks(const BenchmarkOptions&, std::ostream& out);
@@ -1,27 +1,104 @@
 #pragma once
 
+#include <algorithm>
+#include <cassert>
 #include <vector>
 
-template<typename T> 
+// Row by row, or tile by tile with the rows of each tile back to back, so that the elements of a
+// screen tile share a few pages and cache lines
+enum class BufferLayout { LINEAR, TILED };
+
+// 2D array split into tiles, whose sizes are powers of two. The tiles are the unit of the lazy
+// clear: Clear only starts a new generation, and a tile is filled with the clear value the first
+// time ClearTile or ClearStaleTiles finds it stale, so a frame only clears the tiles it touches
+template<typename T>
 class Buffer {
 public:
+	static const int DEFAULT_TILE_SIZE = 32;
+
 	Buffer() = default;
-	Buffer(int n, int m) : width(n), height(m), buffer(n* m) {}
-	Buffer(int n, int m, T val) : width(n), height(m), buffer(n* m, val) {}
+	Buffer(int n, int m) : Buffer(n, m, T()) {}
+	Buffer(int n, int m, T val, int tileWidth = DEFAULT_TILE_SIZE, int tileHeight = DEFAULT_TILE_SIZE, BufferLayout layout = BufferLayout::LINEAR) :
+		width(n), height(m), layout(layout), clearValue(val)
+	{
+		while ((1 << tileShiftX) < tileWidth) tileShiftX++;
+		while ((1 << tileShiftY) < tileHeight) tileShiftY++;
+		tilesX = (n + (1 << tileShiftX) - 1) >> tileShiftX;
+		tilesY = (m + (1 << tileShiftY) - 1) >> tileShiftY;
+		// The tiled layout pads the edge tiles to full size
+		buffer.assign(layout == BufferLayout::TILED ? (size_t)(tilesX * tilesY) << (tileShiftX + tileShiftY) : (size_t)n * m, val);
+		tileGeneration.assign(tilesX * tilesY, generation);
+	}
 
 public:
 	int GetWidth() const { return width; }
 	int GetHeight() const { return height; }
 	T GetValue(int x, int y) const { return buffer[GetIdx(x, y)]; }
 	void SetValue(int x, int y, T val) { buffer[GetIdx(x, y)] = val; }
+	// Linear layout only, a tiled buffer's rows aren't contiguous
+	T* GetRow(int y) {
+		assert(layout == BufferLayout::LINEAR);
+		return buffer.data() + GetIdx(0, y);
+	}
+	const T* GetRow(int y) const {
+		assert(layout == BufferLayout::LINEAR);
+		return buffer.data() + GetIdx(0, y);
+	}
+	// Element (x, y), followed by the rest of its row within its tile in either layout
+	T* GetSpan(int x, int y) { return buffer.data() + GetIdx(x, y); }
+	const T* GetSpan(int x, int y) const { return buffer.data() + GetIdx(x, y); }
+
+	// Fill every element in parallel, which leaves no tile stale
+	void Fill(T val) {
+		const size_t CHUNK = 1 << 16;
+		const int chunks = (int)((buffer.size() + CHUNK - 1) / CHUNK);
+#pragma omp parallel for if (chunks > 1)
+		for (int c = 0; c < chunks; c++) {
+			std::fill(buffer.begin() + c * CHUNK, buffer.begin() + std::min((c + 1) * CHUNK, buffer.size()), val);
+		}
+		std::fill(tileGeneration.begin(), tileGeneration.end(), generation);
+	}
+
+	// Mark every tile stale, in O(1)
+	void Clear() { generation++; }
+	int GetTilesX() const { return tilesX; }
+	int GetTilesY() const { return tilesY; }
+	// Fill the tile with the clear value if it is stale. Tiles are independent, threads may clear
+	// different tiles at the same time
+	void ClearTile(int tx, int ty) {
+		unsigned& tag = tileGeneration[tx + ty * tilesX];
+		if (tag == generation) return;
+		tag = generation;
+		int x0 = tx << tileShiftX, x1 = std::min(x0 + (1 << tileShiftX), width);
+		int y0 = ty << tileShiftY, y1 = std::min(y0 + (1 << tileShiftY), height);
+		for (int y = y0; y < y1; y++) std::fill(GetSpan(x0, y), GetSpan(x0, y) + (x1 - x0), clearValue);
+	}
+	// Clear every stale tile in parallel, before a pass that reads the whole buffer
+	void ClearStaleTiles() {
+		const int tiles = tilesX * tilesY;
+#pragma omp parallel for schedule(dynamic, 16)
+		for (int t = 0; t < tiles; t++) ClearTile(t % tilesX, t / tilesX);
+	}
 
 private:
 	int GetSize() const { return buffer.size(); }
-	int GetIdx(int x, int y) const { return x + y * width; }
+	int GetIdx(int x, int y) const {
+		if (layout == BufferLayout::LINEAR) return x + y * width;
+		int tile = (y >> tileShiftY) * tilesX + (x >> tileShiftX);
+		return (tile << (tileShiftX + tileShiftY)) + ((y & ((1 << tileShiftY) - 1)) << tileShiftX) + (x & ((1 << tileShiftX) - 1));
+	}
 	T GetValue(int idx) const { return buffer[idx]; }
 	void SetValue(int idx, T val) { buffer[idx] = val; }
 
 private:
-	int width, height;
+	int width = 0, height = 0;
+	BufferLayout layout = BufferLayout::LINEAR;
 	std::vector<T> buffer;
+
+	int tileShiftX = 0, tileShiftY = 0;
+	int tilesX = 0, tilesY = 0;
+	T clearValue = T();
+	// Generation each tile was last cleared in, the tile is stale while it lags behind
+	unsigned generation = 0;
+	std::vector<unsigned> tileGeneration;
 };
@@ -1,10 +1,43 @@
 #pragma once
 
+#include <cmath>
+#include <fstream>
+#include <iostream>
 #include "camera.h"
 
 Camera::Camera(const vec3& cameraPos, const vec3& lookatPos) :
-	cameraPos(cameraPos), lookatPos(lookatPos), fovY(45), aspect(1), zNear(0.1), zFar(50)
+	cameraPos(cameraPos), lookatPos(lookatPos), fovY(45), aspect(1), zNear(0.1f), zFar(50)
 {}
-Camera::Camera(const vec3& cameraPos, const vec3& lookatPos, double fovY, double aspect, double zNear, double zFar) :
+Camera::Camera(const vec3& cameraPos, const vec3& lookatPos, float fovY, float aspect, float zNear, float zFar) :
 	cameraPos(cameraPos), lookatPos(lookatPos), fovY(fovY), aspect(aspect), zNear(zNear), zFar(zFar)
 {}
+
+std::vector<Camera> MakeOrbit(const Camera& start, const int frames) {
+	std::vector<Camera> path;
+	vec3 up = vec3(start.upDir).normalize();
+	vec3 offset = start.cameraPos - start.lookatPos;
+	vec3 axial = up * (offset * up);
+	vec3 radial = offset - axial;
+	vec3 side = cross(up, radial);
+	const float PI = 3.14159265f;
+	for (int i = 0; i < frames; i++) {
+		float angle = 2 * PI * i / frames;
+		Camera camera = start;
+		camera.cameraPos = start.lookatPos + axial + radial * std::cos(angle) + side * std::sin(angle);
+		path.push_back(camera);
+	}
+	return path;
+}
+
+bool LoadCameraPath(const std::string filename, const Camera& base, std::vector<Camera>& path) {
+	std::ifstream in(filename);
+	if (!in.is_open()) {
+		std::cerr << "can't open file " << filename << std::endl;
+		return false;
+	}
+	Camera camera = base;
+	while (in >> camera.cameraPos.x >> camera.cameraPos.y >> camera.cameraPos.z >> camera.lookatPos.x >> camera.lookatPos.y >> camera.lookatPos.z) {
+		path.push_back(camera);
+	}
+	return !path.empty();
+}
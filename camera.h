@@ -1,14 +1,22 @@
 #pragma once
 
+#include <string>
+#include <vector>
 #include "geometry.h"
 
 class Camera {
 public:
 	vec3 cameraPos, lookatPos;
 	vec3 upDir = { 0, 1, 0 };
-	double fovY, aspect, zNear, zFar;
+	float fovY, aspect, zNear, zFar;
 
 	Camera() = default;
 	Camera(const vec3& cameraPos, const vec3& lookatPos);
-	Camera(const vec3& cameraPos, const vec3& lookatPos, double fovY, double aspect, double zNear, double zFar);
+	Camera(const vec3& cameraPos, const vec3& lookatPos, float fovY, float aspect, float zNear, float zFar);
 };
+
+// Cameras for batch rendering. An orbit turns the camera once around the up axis through its
+// look-at point in the given number of frames. A path file lists one camera per line as
+// "posX posY posZ lookatX lookatY lookatZ", the other parameters are copied from base
+std::vector<Camera> MakeOrbit(const Camera& start, const int frames);
+bool LoadCameraPath(const std::string filename, const Camera& base, std::vector<Camera>& path);
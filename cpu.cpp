@@ -0,0 +1,25 @@
+#include "cpu.h"
+
+#if defined(_MSC_VER) && defined(QS_SSE2)
+#include <intrin.h>
+#endif
+
+SimdLevel DetectSimdLevel() {
+#if !defined(QS_SSE2)
+	return SimdLevel::SCALAR;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) return SimdLevel::SSE2;
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	// The OS has to save the YMM registers on context switch
+	if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) return SimdLevel::SSE2;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) ? SimdLevel::AVX2 : SimdLevel::SSE2;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") ? SimdLevel::AVX2 : SimdLevel::SSE2;
+#endif
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#if defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define QS_SSE2 1
+#include <immintrin.h>
+#endif
+
+// GCC and Clang only emit AVX2 instructions inside functions that ask for them
+#if defined(QS_SSE2) && (defined(__GNUC__) || defined(__clang__))
+#define QS_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define QS_TARGET_AVX2
+#endif
+
+// Widest instruction set the rasterizer can use on this machine
+enum class SimdLevel { SCALAR, SSE2, AVX2 };
+
+SimdLevel DetectSimdLevel();
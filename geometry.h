@@ -3,82 +3,112 @@
 #include <cmath>
 #include <cassert>
 #include <iostream>
+#include "cpu.h"
 
-template<int n> struct vec {
+// The pipeline works in float, vec<n, double> / mat<n, m, double> remain available for tools
+template<int n, typename T = float> struct vec {
+	typedef T value_type;
 	vec() = default;
-	double& operator[](const int i) { assert(i >= 0 && i < n); return data[i]; }
-	const double operator[](const int i) const { assert(i >= 0 && i < n); return data[i]; }
-	double norm2() const { return *this * *this; }
-	double norm() const { return std::sqrt(norm2()); }
-	double data[n] = { 0 };
+	T& operator[](const int i) { assert(i >= 0 && i < n); return data[i]; }
+	const T operator[](const int i) const { assert(i >= 0 && i < n); return data[i]; }
+	T norm2() const { return *this * *this; }
+	T norm() const { return std::sqrt(norm2()); }
+	T data[n] = { 0 };
 };
 
-template<int n1, int n2> vec<n1> embed(const vec<n2>& v, double fill = 1) { vec<n1> ret; for (int i = 0; i < n1; i++) { ret[i] = (i < n2 ? v[i] : fill); } return ret; }
+// Scalar arguments use value_type so that literals and doubles convert instead of failing deduction
+template<int n1, int n2, typename T> vec<n1, T> embed(const vec<n2, T>& v, const typename vec<n2, T>::value_type fill = 1) { vec<n1, T> ret; for (int i = 0; i < n1; i++) { ret[i] = (i < n2 ? v[i] : fill); } return ret; }
 
-template<int n1, int n2> vec<n1> proj(const vec<n2>& v) { vec<n1> ret; for (int i = 0; i < n1; i++) { ret[i] = v[i]; } return ret; }
+template<int n1, int n2, typename T> vec<n1, T> proj(const vec<n2, T>& v) { vec<n1, T> ret; for (int i = 0; i < n1; i++) { ret[i] = v[i]; } return ret; }
 
-template<int n> double operator*(const vec<n>& lhs, const vec<n>& rhs) { double ret = 0;	for (int i = 0; i < n; i++) { ret += lhs[i] * rhs[i]; }	return ret; }
-template<int n> vec<n> operator+(const vec<n>& lhs, const vec<n>& rhs) { vec<n> ret = lhs; for (int i = 0; i < n; i++) { ret[i] += rhs[i]; } return ret; }
-template<int n> vec<n> operator-(const vec<n>& lhs, const vec<n>& rhs) { vec<n> ret = lhs; for (int i = 0; i < n; i++) { ret[i] -= rhs[i]; } return ret; }
-template<int n> vec<n> operator*(const double& rhs, const vec<n>& lhs) { vec<n> ret = lhs; for (int i = 0; i < n; i++) { ret[i] *= rhs; } return ret; }
-template<int n> vec<n> operator*(const vec<n>& lhs, const double& rhs) { vec<n> ret = lhs; for (int i = 0; i < n; i++) { ret[i] *= rhs; } return ret; }
-template<int n> vec<n> operator/(const vec<n>& lhs, const double& rhs) { vec<n> ret = lhs; for (int i = 0; i < n; i++) { ret[i] /= rhs; } return ret; }
-template<int n> std::ostream& operator<<(std::ostream& out, const vec<n>& v) { for (int i = 0; i < n; i++) { out << v[i] << " "; }	return out; }
+template<int n, typename T> T operator*(const vec<n, T>& lhs, const vec<n, T>& rhs) { T ret = 0;	for (int i = 0; i < n; i++) { ret += lhs[i] * rhs[i]; }	return ret; }
+template<int n, typename T> vec<n, T> operator+(const vec<n, T>& lhs, const vec<n, T>& rhs) { vec<n, T> ret = lhs; for (int i = 0; i < n; i++) { ret[i] += rhs[i]; } return ret; }
+template<int n, typename T> vec<n, T> operator-(const vec<n, T>& lhs, const vec<n, T>& rhs) { vec<n, T> ret = lhs; for (int i = 0; i < n; i++) { ret[i] -= rhs[i]; } return ret; }
+template<int n, typename T> vec<n, T> operator*(const typename vec<n, T>::value_type& rhs, const vec<n, T>& lhs) { vec<n, T> ret = lhs; for (int i = 0; i < n; i++) { ret[i] *= rhs; } return ret; }
+template<int n, typename T> vec<n, T> operator*(const vec<n, T>& lhs, const typename vec<n, T>::value_type& rhs) { vec<n, T> ret = lhs; for (int i = 0; i < n; i++) { ret[i] *= rhs; } return ret; }
+template<int n, typename T> vec<n, T> operator/(const vec<n, T>& lhs, const typename vec<n, T>::value_type& rhs) { vec<n, T> ret = lhs; for (int i = 0; i < n; i++) { ret[i] /= rhs; } return ret; }
+template<int n, typename T> std::ostream& operator<<(std::ostream& out, const vec<n, T>& v) { for (int i = 0; i < n; i++) { out << v[i] << " "; }	return out; }
 
-template<> struct vec<2> {
+template<typename T> struct vec<2, T> {
+	typedef T value_type;
 	vec() = default;
-	vec(double x, double y) : x(x), y(y) {}
-	double& operator[](const int i) { assert(i >= 0 && i < 2); return i ? y : x; }
-	double  operator[](const int i) const { assert(i >= 0 && i < 2); return i ? y : x; }
-	double norm2() const { return *this * *this; }
-	double norm()  const { return std::sqrt(norm2()); }
+	vec(T x, T y) : x(x), y(y) {}
+	T& operator[](const int i) { assert(i >= 0 && i < 2); return i ? y : x; }
+	T  operator[](const int i) const { assert(i >= 0 && i < 2); return i ? y : x; }
+	T norm2() const { return *this * *this; }
+	T norm()  const { return std::sqrt(norm2()); }
 	vec& normalize() { *this = (*this) / norm(); return *this; }
-	double x{}, y{};
+	T x{}, y{};
 };
 
-template<> struct vec<3> {
+template<typename T> struct vec<3, T> {
+	typedef T value_type;
 	vec() = default;
-	vec(double x, double y, double z) : x(x), y(y), z(z) {}
-	double& operator[](const int i) { assert(i >= 0 && i < 3); return i ? (1 == i ? y : z) : x; }
-	double  operator[](const int i) const { assert(i >= 0 && i < 3); return i ? (1 == i ? y : z) : x; }
-	double norm2() const { return *this * *this; }
-	double norm()  const { return std::sqrt(norm2()); }
+	vec(T x, T y, T z) : x(x), y(y), z(z) {}
+	T& operator[](const int i) { assert(i >= 0 && i < 3); return i ? (1 == i ? y : z) : x; }
+	T  operator[](const int i) const { assert(i >= 0 && i < 3); return i ? (1 == i ? y : z) : x; }
+	T norm2() const { return *this * *this; }
+	T norm()  const { return std::sqrt(norm2()); }
 	vec& normalize() { *this = (*this) / norm(); return *this; }
-	double x{}, y{}, z{};
+	T x{}, y{}, z{};
 };
 
+// Aligned so that homogeneous positions and matrix rows load straight into SSE registers
+template<> struct alignas(16) vec<4, float> {
+	typedef float value_type;
+	vec() = default;
+	vec(float x, float y, float z, float w) : data{ x, y, z, w } {}
+	float& operator[](const int i) { assert(i >= 0 && i < 4); return data[i]; }
+	float  operator[](const int i) const { assert(i >= 0 && i < 4); return data[i]; }
+	float norm2() const { return *this * *this; }
+	float norm()  const { return std::sqrt(norm2()); }
+	float data[4] = { 0 };
+};
+
+#if defined(QS_SSE2)
+inline vec<4, float> operator+(const vec<4, float>& lhs, const vec<4, float>& rhs) { vec<4, float> ret; _mm_store_ps(ret.data, _mm_add_ps(_mm_load_ps(lhs.data), _mm_load_ps(rhs.data))); return ret; }
+inline vec<4, float> operator-(const vec<4, float>& lhs, const vec<4, float>& rhs) { vec<4, float> ret; _mm_store_ps(ret.data, _mm_sub_ps(_mm_load_ps(lhs.data), _mm_load_ps(rhs.data))); return ret; }
+inline vec<4, float> operator*(const float& rhs, const vec<4, float>& lhs) { vec<4, float> ret; _mm_store_ps(ret.data, _mm_mul_ps(_mm_load_ps(lhs.data), _mm_set1_ps(rhs))); return ret; }
+inline vec<4, float> operator*(const vec<4, float>& lhs, const float& rhs) { vec<4, float> ret; _mm_store_ps(ret.data, _mm_mul_ps(_mm_load_ps(lhs.data), _mm_set1_ps(rhs))); return ret; }
+inline vec<4, float> operator/(const vec<4, float>& lhs, const float& rhs) { vec<4, float> ret; _mm_store_ps(ret.data, _mm_div_ps(_mm_load_ps(lhs.data), _mm_set1_ps(rhs))); return ret; }
+#endif
+
 typedef vec<2> vec2;
 typedef vec<3> vec3;
 typedef vec<4> vec4;
+typedef vec<2, double> dvec2;
+typedef vec<3, double> dvec3;
+typedef vec<4, double> dvec4;
 vec3 cross(const vec3& v1, const vec3& v2);
 
-template<int n> struct dt;
+template<int n, typename T> struct dt;
+template<int n, typename T> struct inverse;
 
 
-template<int n, int m>
+template<int n, int m, typename T = float>
 struct mat {
-	vec<m> rows[n] = { {} };
+	vec<m, T> rows[n] = { {} };
 
-	vec<m>& operator[] (const int idx) {
+	vec<m, T>& operator[] (const int idx) {
 		assert(idx >= 0 && idx < n);
 		return rows[idx];
 	}
 
-	const vec<m>& operator[] (const int idx) const {
+	const vec<m, T>& operator[] (const int idx) const {
 		assert(idx >= 0 && idx < n);
 		return rows[idx];
 	}
 
-	vec<n> col(const int idx) const {
+	vec<n, T> col(const int idx) const {
 		assert(idx >= 0 && idx < m);
-		vec<n> ret;
+		vec<n, T> ret;
 		for (int i = 0; i < n; i++) {
 			ret[i] = rows[i][idx];
 		}
 		return ret;
 	}
 
-	void set_col(const int idx, const vec<n>& v) {
+	void set_col(const int idx, const vec<n, T>& v) {
 		assert(idx >= 0 && idx < m);
 		for (int i = 0; i < n; i++) {
 			rows[i][idx] = v[i];
@@ -86,8 +116,8 @@ struct mat {
 		return;
 	}
 
-	static mat<n, m> identity() {
-		mat<n, m> ret;
+	static mat<n, m, T> identity() {
+		mat<n, m, T> ret;
 		for (int i = 0; i < n; i++) {
 			for (int j = 0; j < m; j++) {
 				ret[i][j] = (i == j);
@@ -96,12 +126,12 @@ struct mat {
 		return ret;
 	}
 
-	double det() const {
-		return dt<m>::det(*this);
+	T det() const {
+		return dt<m, T>::det(*this);
 	}
 
-	mat<n - 1, m - 1> get_minor(const int row, const int col) const {
-		mat<n - 1, m - 1> ret;
+	mat<n - 1, m - 1, T> get_minor(const int row, const int col) const {
+		mat<n - 1, m - 1, T> ret;
 		for (int i = 0; i < n - 1; i++) {
 			for (int j = 0; j < m - 1; j++) {
 				ret[i][j] = rows[i < row ? i : i + 1][j < col ? j : j + 1];
@@ -110,12 +140,12 @@ struct mat {
 		return ret;
 	}
 
-	double cofactor(const int row, const int col) const {
+	T cofactor(const int row, const int col) const {
 		return get_minor(row, col).det() * ((row + col) % 2 ? -1 : 1);
 	}
 
-	mat<n, m> adjugate() const {
-		mat<n, m> ret;
+	mat<n, m, T> adjugate() const {
+		mat<n, m, T> ret;
 		for (int i = 0; i < n; i++) {
 			for (int j = 0; j < m; j++) {
 				ret[i][j] = cofactor(i, j);
@@ -124,17 +154,16 @@ struct mat {
 		return ret;
 	}
 
-	mat<n, m> invert_transpose() const {
-		mat<n, m> ret = adjugate();
-		return ret / (ret[0] * rows[0]);
+	mat<n, m, T> invert_transpose() const {
+		return inverse<n, T>::invert_transpose(*this);
 	}
 
-	mat<n, m> invert() const {
+	mat<n, m, T> invert() const {
 		return invert_transpose().transpose();
 	}
 
-	mat<m, n> transpose() const {
-		mat<m, n> ret;
+	mat<m, n, T> transpose() const {
+		mat<m, n, T> ret;
 		for (int i = 0; i < m; i++) {
 			ret[i] = this->col(i);
 		}
@@ -143,10 +172,10 @@ struct mat {
 };
 
 
-template<int n>
+template<int n, typename T>
 struct dt {
-	static double det(const mat<n, n>& src) {
-		double ret = 0;
+	static T det(const mat<n, n, T>& src) {
+		T ret = 0;
 		for (int i = 0; i < n; i++) {
 			ret += src[0][i] * src.cofactor(0, i);
 		}
@@ -154,25 +183,108 @@ struct dt {
 	}
 };
 
-template<>
-struct dt<1> {
-	static double det(const mat<1, 1>& src) {
+template<typename T>
+struct dt<1, T> {
+	static T det(const mat<1, 1, T>& src) {
 		return src[0][0];
 	}
 };
 
-template<int n, int m>
-vec<n> operator*(const mat<n, m>& lhs, const vec<m>& rhs) {
-	vec<n> ret;
+template<typename T>
+struct dt<2, T> {
+	static T det(const mat<2, 2, T>& src) {
+		return src[0][0] * src[1][1] - src[0][1] * src[1][0];
+	}
+};
+
+template<typename T>
+struct dt<3, T> {
+	static T det(const mat<3, 3, T>& a) {
+		return a[0][0] * (a[1][1] * a[2][2] - a[1][2] * a[2][1])
+			+ a[0][1] * (a[1][2] * a[2][0] - a[1][0] * a[2][2])
+			+ a[0][2] * (a[1][0] * a[2][1] - a[1][1] * a[2][0]);
+	}
+};
+
+template<typename T>
+struct dt<4, T> {
+	static T det(const mat<4, 4, T>& a) {
+		T s0 = a[0][0] * a[1][1] - a[1][0] * a[0][1], s1 = a[0][0] * a[1][2] - a[1][0] * a[0][2];
+		T s2 = a[0][0] * a[1][3] - a[1][0] * a[0][3], s3 = a[0][1] * a[1][2] - a[1][1] * a[0][2];
+		T s4 = a[0][1] * a[1][3] - a[1][1] * a[0][3], s5 = a[0][2] * a[1][3] - a[1][2] * a[0][3];
+		T c0 = a[2][0] * a[3][1] - a[3][0] * a[2][1], c1 = a[2][0] * a[3][2] - a[3][0] * a[2][2];
+		T c2 = a[2][0] * a[3][3] - a[3][0] * a[2][3], c3 = a[2][1] * a[3][2] - a[3][1] * a[2][2];
+		T c4 = a[2][1] * a[3][3] - a[3][1] * a[2][3], c5 = a[2][2] * a[3][3] - a[3][2] * a[2][3];
+		return s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0;
+	}
+};
+
+
+template<int n, typename T>
+struct inverse {
+	static mat<n, n, T> invert_transpose(const mat<n, n, T>& src) {
+		mat<n, n, T> ret = src.adjugate();
+		return ret / (ret[0] * src[0]);
+	}
+};
+
+// Closed-form cofactors instead of the recursive minors
+template<typename T>
+struct inverse<3, T> {
+	static mat<3, 3, T> invert_transpose(const mat<3, 3, T>& a) {
+		mat<3, 3, T> ret = { {
+			{ a[1][1] * a[2][2] - a[1][2] * a[2][1], a[1][2] * a[2][0] - a[1][0] * a[2][2], a[1][0] * a[2][1] - a[1][1] * a[2][0] },
+			{ a[0][2] * a[2][1] - a[0][1] * a[2][2], a[0][0] * a[2][2] - a[0][2] * a[2][0], a[0][1] * a[2][0] - a[0][0] * a[2][1] },
+			{ a[0][1] * a[1][2] - a[0][2] * a[1][1], a[0][2] * a[1][0] - a[0][0] * a[1][2], a[0][0] * a[1][1] - a[0][1] * a[1][0] }
+		} };
+		return ret / (ret[0] * a[0]);
+	}
+};
+
+template<typename T>
+struct inverse<4, T> {
+	static mat<4, 4, T> invert_transpose(const mat<4, 4, T>& a) {
+		T s0 = a[0][0] * a[1][1] - a[1][0] * a[0][1], s1 = a[0][0] * a[1][2] - a[1][0] * a[0][2];
+		T s2 = a[0][0] * a[1][3] - a[1][0] * a[0][3], s3 = a[0][1] * a[1][2] - a[1][1] * a[0][2];
+		T s4 = a[0][1] * a[1][3] - a[1][1] * a[0][3], s5 = a[0][2] * a[1][3] - a[1][2] * a[0][3];
+		T c0 = a[2][0] * a[3][1] - a[3][0] * a[2][1], c1 = a[2][0] * a[3][2] - a[3][0] * a[2][2];
+		T c2 = a[2][0] * a[3][3] - a[3][0] * a[2][3], c3 = a[2][1] * a[3][2] - a[3][1] * a[2][2];
+		T c4 = a[2][1] * a[3][3] - a[3][1] * a[2][3], c5 = a[2][2] * a[3][3] - a[3][2] * a[2][3];
+		T invDet = 1 / (s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0);
+
+		mat<4, 4, T> ret;
+		ret[0][0] = (a[1][1] * c5 - a[1][2] * c4 + a[1][3] * c3) * invDet;
+		ret[1][0] = (-a[0][1] * c5 + a[0][2] * c4 - a[0][3] * c3) * invDet;
+		ret[2][0] = (a[3][1] * s5 - a[3][2] * s4 + a[3][3] * s3) * invDet;
+		ret[3][0] = (-a[2][1] * s5 + a[2][2] * s4 - a[2][3] * s3) * invDet;
+		ret[0][1] = (-a[1][0] * c5 + a[1][2] * c2 - a[1][3] * c1) * invDet;
+		ret[1][1] = (a[0][0] * c5 - a[0][2] * c2 + a[0][3] * c1) * invDet;
+		ret[2][1] = (-a[3][0] * s5 + a[3][2] * s2 - a[3][3] * s1) * invDet;
+		ret[3][1] = (a[2][0] * s5 - a[2][2] * s2 + a[2][3] * s1) * invDet;
+		ret[0][2] = (a[1][0] * c4 - a[1][1] * c2 + a[1][3] * c0) * invDet;
+		ret[1][2] = (-a[0][0] * c4 + a[0][1] * c2 - a[0][3] * c0) * invDet;
+		ret[2][2] = (a[3][0] * s4 - a[3][1] * s2 + a[3][3] * s0) * invDet;
+		ret[3][2] = (-a[2][0] * s4 + a[2][1] * s2 - a[2][3] * s0) * invDet;
+		ret[0][3] = (-a[1][0] * c3 + a[1][1] * c1 - a[1][2] * c0) * invDet;
+		ret[1][3] = (a[0][0] * c3 - a[0][1] * c1 + a[0][2] * c0) * invDet;
+		ret[2][3] = (-a[3][0] * s3 + a[3][1] * s1 - a[3][2] * s0) * invDet;
+		ret[3][3] = (a[2][0] * s3 - a[2][1] * s1 + a[2][2] * s0) * invDet;
+		return ret;
+	}
+};
+
+template<int n, int m, typename T>
+vec<n, T> operator*(const mat<n, m, T>& lhs, const vec<m, T>& rhs) {
+	vec<n, T> ret;
 	for (int i = 0; i < n; i++) {
 		ret[i] = lhs[i] * rhs;
 	}
 	return ret;
 }
 
-template<int R1, int C1, int C2>
-mat<R1, C2> operator*(const mat<R1, C1>& lhs, const mat<C1, C2>& rhs) {
-	mat<R1, C2> result;
+template<int R1, int C1, int C2, typename T>
+mat<R1, C2, T> operator*(const mat<R1, C1, T>& lhs, const mat<C1, C2, T>& rhs) {
+	mat<R1, C2, T> result;
 	for (int i = 0; i < R1; i++) {
 		for (int j = 0; j < C2; j++) {
 			result[i][j] = lhs[i] * rhs.col(j);
@@ -181,27 +293,27 @@ mat<R1, C2> operator*(const mat<R1, C1>& lhs, const mat<C1, C2>& rhs) {
 	return result;
 }
 
-template<int n, int m>
-mat<n, m> operator*(const mat<n, m>& lhs, const double& val) {
-	mat<n, m> result;
+template<int n, int m, typename T>
+mat<n, m, T> operator*(const mat<n, m, T>& lhs, const typename vec<m, T>::value_type& val) {
+	mat<n, m, T> result;
 	for (int i = 0; i < n; i++) {
 		result[i] = lhs[i] * val;
 	}
 	return result;
 }
 
-template<int n, int m>
-mat<n, m> operator/(const mat<n, m>& lhs, const double& val) {
-	mat<n, m> result;
+template<int n, int m, typename T>
+mat<n, m, T> operator/(const mat<n, m, T>& lhs, const typename vec<m, T>::value_type& val) {
+	mat<n, m, T> result;
 	for (int i = 0; i < n; i++) {
 		result[i] = lhs[i] / val;
 	}
 	return result;
 }
 
-template<int n, int m>
-mat<n, m> operator+(const mat<n, m>& lhs, const mat<n, m>& rhs) {
-	mat<n, m> result;
+template<int n, int m, typename T>
+mat<n, m, T> operator+(const mat<n, m, T>& lhs, const mat<n, m, T>& rhs) {
+	mat<n, m, T> result;
 	for (int i = 0; i < n; i++) {
 		for (int j = 0; j < m; j++) {
 			result[i][j] = lhs[i][j] + rhs[i][j];
@@ -210,9 +322,9 @@ mat<n, m> operator+(const mat<n, m>& lhs, const mat<n, m>& rhs) {
 	return result;
 }
 
-template<int n, int m>
-mat<n, m> operator-(const mat<n, m>& lhs, const mat<n, m>& rhs) {
-	mat<n, m> result;
+template<int n, int m, typename T>
+mat<n, m, T> operator-(const mat<n, m, T>& lhs, const mat<n, m, T>& rhs) {
+	mat<n, m, T> result;
 	for (int i = 0; i < n; i++) {
 		for (int j = 0; j < m; j++) {
 			result[i][j] = lhs[i][j] - rhs[i][j];
@@ -221,10 +333,54 @@ mat<n, m> operator-(const mat<n, m>& lhs, const mat<n, m>& rhs) {
 	return result;
 }
 
-template<int n, int m>
-std::ostream& operator<<(std::ostream& out, const mat<n, m>& matrix) {
+template<int n, int m, typename T>
+std::ostream& operator<<(std::ostream& out, const mat<n, m, T>& matrix) {
 	for (int i = 0; i < n; i++) {
 		out << matrix[i] << std::endl;
 	}
 	return out;
 }
+
+#if defined(QS_SSE2)
+// mat<4, 4> rows are aligned vec4, so the transforms in every vertex() run on whole registers
+
+template<>
+inline mat<4, 4, float> mat<4, 4, float>::transpose() const {
+	__m128 r0 = _mm_load_ps(rows[0].data), r1 = _mm_load_ps(rows[1].data);
+	__m128 r2 = _mm_load_ps(rows[2].data), r3 = _mm_load_ps(rows[3].data);
+	_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+	mat<4, 4, float> ret;
+	_mm_store_ps(ret[0].data, r0);
+	_mm_store_ps(ret[1].data, r1);
+	_mm_store_ps(ret[2].data, r2);
+	_mm_store_ps(ret[3].data, r3);
+	return ret;
+}
+
+inline vec<4, float> operator*(const mat<4, 4, float>& lhs, const vec<4, float>& rhs) {
+	__m128 c0 = _mm_load_ps(lhs[0].data), c1 = _mm_load_ps(lhs[1].data);
+	__m128 c2 = _mm_load_ps(lhs[2].data), c3 = _mm_load_ps(lhs[3].data);
+	_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+	__m128 ret = _mm_mul_ps(c0, _mm_set1_ps(rhs[0]));
+	ret = _mm_add_ps(ret, _mm_mul_ps(c1, _mm_set1_ps(rhs[1])));
+	ret = _mm_add_ps(ret, _mm_mul_ps(c2, _mm_set1_ps(rhs[2])));
+	ret = _mm_add_ps(ret, _mm_mul_ps(c3, _mm_set1_ps(rhs[3])));
+	vec<4, float> result;
+	_mm_store_ps(result.data, ret);
+	return result;
+}
+
+inline mat<4, 4, float> operator*(const mat<4, 4, float>& lhs, const mat<4, 4, float>& rhs) {
+	__m128 b0 = _mm_load_ps(rhs[0].data), b1 = _mm_load_ps(rhs[1].data);
+	__m128 b2 = _mm_load_ps(rhs[2].data), b3 = _mm_load_ps(rhs[3].data);
+	mat<4, 4, float> result;
+	for (int i = 0; i < 4; i++) {
+		__m128 row = _mm_mul_ps(_mm_set1_ps(lhs[i][0]), b0);
+		row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(lhs[i][1]), b1));
+		row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(lhs[i][2]), b2));
+		row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(lhs[i][3]), b3));
+		_mm_store_ps(result[i].data, row);
+	}
+	return result;
+}
+#endif
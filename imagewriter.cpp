@@ -0,0 +1,316 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include "imagewriter.h"
+#include "profiler.h"
+
+#if defined(QS_ZLIB)
+#include <zlib.h>
+#endif
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+ImageFormat GetImageFormat(const std::string filename) {
+	size_t dot = filename.find_last_of(".");
+	std::string ext = dot == std::string::npos ? "" : filename.substr(dot + 1);
+	if (ext == "ppm") return ImageFormat::PPM;
+	if (ext == "png") return ImageFormat::PNG;
+	if (ext == "rgb" || ext == "raw") return ImageFormat::RAW;
+	return ImageFormat::TGA;
+}
+
+static void Append(std::vector<std::uint8_t>& out, const void* data, const std::size_t size) {
+	const std::uint8_t* p = static_cast<const std::uint8_t*>(data);
+	out.insert(out.end(), p, p + size);
+}
+
+static void AppendBigEndian(std::vector<std::uint8_t>& out, const std::uint32_t val) {
+	std::uint8_t bytes[4] = { std::uint8_t(val >> 24), std::uint8_t(val >> 16), std::uint8_t(val >> 8), std::uint8_t(val) };
+	Append(out, bytes, 4);
+}
+
+// Run-length encoded like TGAImage::write_tga_file: packets of up to 128 equal pixels, and raw
+// packets of up to 128 pixels between them
+static void EncodeTGA(const RGBImage& image, std::vector<std::uint8_t>& out) {
+	const std::size_t MAX_PACKET = 128;
+	std::uint8_t header[18] = {};
+	header[2] = 10;
+	header[12] = std::uint8_t(image.width);
+	header[13] = std::uint8_t(image.width >> 8);
+	header[14] = std::uint8_t(image.height);
+	header[15] = std::uint8_t(image.height >> 8);
+	header[16] = 24;
+	Append(out, header, sizeof(header));
+
+	const std::uint8_t* src = image.data.data();
+	const std::size_t npixels = (std::size_t)image.width * image.height;
+	auto same = [src](const std::size_t a, const std::size_t b) { return !std::memcmp(src + a * 3, src + b * 3, 3); };
+	// TGA stores BGR
+	auto appendPixel = [&](const std::size_t p) {
+		const std::uint8_t bgr[3] = { src[p * 3 + 2], src[p * 3 + 1], src[p * 3] };
+		Append(out, bgr, 3);
+	};
+	for (std::size_t pixel = 0; pixel < npixels;) {
+		std::size_t length = 1;
+		bool raw = true;
+		while (pixel + length < npixels && length < MAX_PACKET) {
+			bool equal = same(pixel + length - 1, pixel + length);
+			if (length == 1) raw = !equal;
+			// A raw packet stops before the pixel that starts a run
+			if (raw && equal) {
+				length--;
+				break;
+			}
+			if (!raw && !equal) break;
+			length++;
+		}
+		out.push_back(std::uint8_t(raw ? length - 1 : length + 127));
+		if (raw) {
+			for (std::size_t k = 0; k < length; k++) appendPixel(pixel + k);
+		}
+		else {
+			appendPixel(pixel);
+		}
+		pixel += length;
+	}
+
+	const std::uint8_t footer[26] = { 0, 0, 0, 0, 0, 0, 0, 0, 'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0' };
+	Append(out, footer, sizeof(footer));
+}
+
+static void AppendRowsTopDown(const RGBImage& image, std::vector<std::uint8_t>& out) {
+	for (int y = image.height - 1; y >= 0; y--) Append(out, image.GetRow(y), image.width * 3);
+}
+
+static void EncodePPM(const RGBImage& image, std::vector<std::uint8_t>& out) {
+	char header[64];
+	int len = std::snprintf(header, sizeof(header), "P6\n%d %d\n255\n", image.width, image.height);
+	Append(out, header, len);
+	AppendRowsTopDown(image, out);
+}
+
+static std::uint32_t Crc32(const std::uint8_t* data, const std::size_t size, std::uint32_t crc = 0) {
+	static std::uint32_t table[256];
+	static bool tableReady = [] {
+		for (std::uint32_t n = 0; n < 256; n++) {
+			std::uint32_t c = n;
+			for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+		return true;
+	}();
+	(void)tableReady;
+	crc = ~crc;
+	for (std::size_t i = 0; i < size; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void AppendChunk(std::vector<std::uint8_t>& out, const char type[4], const std::vector<std::uint8_t>& body) {
+	AppendBigEndian(out, (std::uint32_t)body.size());
+	std::size_t start = out.size();
+	Append(out, type, 4);
+	Append(out, body.data(), body.size());
+	AppendBigEndian(out, Crc32(out.data() + start, out.size() - start));
+}
+
+// zlib stream of the scanlines, each prefixed with filter type 0
+static void DeflateScanlines(const RGBImage& image, std::vector<std::uint8_t>& out) {
+	std::vector<std::uint8_t> raw;
+	raw.reserve((image.width * 3 + 1) * image.height);
+	for (int y = image.height - 1; y >= 0; y--) {
+		raw.push_back(0);
+		Append(raw, image.GetRow(y), image.width * 3);
+	}
+#if defined(QS_ZLIB)
+	uLongf size = compressBound((uLong)raw.size());
+	out.resize(size);
+	compress2(out.data(), &size, raw.data(), (uLong)raw.size(), Z_BEST_SPEED);
+	out.resize(size);
+#else
+	// Stored deflate blocks of at most 65535 bytes
+	out = { 0x78, 0x01 };
+	std::size_t pos = 0;
+	do {
+		std::size_t len = std::min<std::size_t>(65535, raw.size() - pos);
+		bool last = pos + len == raw.size();
+		std::uint8_t header[5] = { std::uint8_t(last), std::uint8_t(len), std::uint8_t(len >> 8), std::uint8_t(~len), std::uint8_t(~len >> 8) };
+		Append(out, header, 5);
+		Append(out, raw.data() + pos, len);
+		pos += len;
+	} while (pos < raw.size());
+	std::uint32_t a = 1, b = 0;
+	for (std::uint8_t c : raw) {
+		a = (a + c) % 65521;
+		b = (b + a) % 65521;
+	}
+	AppendBigEndian(out, b << 16 | a);
+#endif
+}
+
+static void EncodePNG(const RGBImage& image, std::vector<std::uint8_t>& out) {
+	const std::uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	Append(out, signature, sizeof(signature));
+
+	std::vector<std::uint8_t> ihdr;
+	AppendBigEndian(ihdr, image.width);
+	AppendBigEndian(ihdr, image.height);
+	const std::uint8_t format[5] = { 8, 2, 0, 0, 0 };
+	Append(ihdr, format, sizeof(format));
+	AppendChunk(out, "IHDR", ihdr);
+
+	std::vector<std::uint8_t> idat;
+	DeflateScanlines(image, idat);
+	AppendChunk(out, "IDAT", idat);
+	AppendChunk(out, "IEND", {});
+}
+
+void EncodeImage(const RGBImage& image, const ImageFormat format, std::vector<std::uint8_t>& out) {
+	out.clear();
+	switch (format) {
+	case ImageFormat::PPM: EncodePPM(image, out); break;
+	case ImageFormat::PNG: EncodePNG(image, out); break;
+	case ImageFormat::RAW: AppendRowsTopDown(image, out); break;
+	default: EncodeTGA(image, out); break;
+	}
+}
+
+static bool WriteEncoded(const std::vector<std::uint8_t>& encoded, const std::string& filename) {
+	std::ofstream out(filename, std::ios::binary);
+	if (!out.is_open()) {
+		std::cerr << "can't open file " << filename << std::endl;
+		return false;
+	}
+	out.write(reinterpret_cast<const char*>(encoded.data()), encoded.size());
+	if (!out.good()) {
+		std::cerr << "can't write file " << filename << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool WriteImage(const RGBImage& image, const std::string filename) {
+	std::vector<std::uint8_t> encoded;
+	EncodeImage(image, GetImageFormat(filename), encoded);
+	return WriteEncoded(encoded, filename);
+}
+
+FileSink::FileSink(const std::string name, const std::string extension, const bool numbered) : name(name), extension(extension), numbered(numbered) {}
+
+bool FileSink::Write(const RGBImage& image, const int frame) {
+	std::string filename = name;
+	if (numbered) {
+		char number[16];
+		std::snprintf(number, sizeof(number), "_%04d", frame);
+		filename += number;
+	}
+	filename += "." + extension;
+	// The encode buffer keeps its capacity from frame to frame
+	EncodeImage(image, GetImageFormat(filename), encoded);
+	return WriteEncoded(encoded, filename);
+}
+
+StreamSink::StreamSink(const std::string path) {
+	ownsStream = path != "-";
+	if (ownsStream) {
+		stream = std::fopen(path.c_str(), "wb");
+	}
+	else {
+		stream = stdout;
+#if defined(_WIN32)
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	}
+	if (!stream) std::cerr << "error: can't open stream " << path << std::endl;
+}
+
+StreamSink::~StreamSink() {
+	if (!stream) return;
+	if (ownsStream) std::fclose(stream);
+	else std::fflush(stream);
+}
+
+bool StreamSink::IsOpen() const {
+	return stream != nullptr;
+}
+
+bool StreamSink::Write(const RGBImage& image, const int) {
+	if (!stream) return false;
+	EncodeImage(image, ImageFormat::RAW, encoded);
+	// Flush per frame so the reader on the other end of a pipe sees whole frames
+	return std::fwrite(encoded.data(), 1, encoded.size(), stream) == encoded.size() && std::fflush(stream) == 0;
+}
+
+ImageWriter::ImageWriter(std::unique_ptr<FrameSink> sink, const int maxQueued) : sink(std::move(sink)), maxQueued(std::max(maxQueued, 1)) {
+	queue.resize(this->maxQueued);
+	// The queued images, the one being written and the one being rendered
+	freeImages.reserve(this->maxQueued + 2);
+	worker = std::thread(&ImageWriter::WorkerMain, this);
+}
+
+ImageWriter::~ImageWriter() {
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		stopping = true;
+	}
+	queueChanged.notify_all();
+	worker.join();
+}
+
+void ImageWriter::WorkerMain() {
+	Profiler::SetThreadName("image writer");
+	std::unique_lock<std::mutex> lock(queueMutex);
+	while (true) {
+		queueChanged.wait(lock, [this] { return stopping || queueCount > 0; });
+		if (queueCount == 0) return;
+		Job job = std::move(queue[queueFront]);
+		queueFront = (queueFront + 1) % maxQueued;
+		queueCount--;
+		busy = true;
+		queueChanged.notify_all();
+
+		lock.unlock();
+		bool ok;
+		{
+			QS_PROFILE_SCOPE("write");
+			ok = sink->Write(job.image, job.frame);
+		}
+		lock.lock();
+		if (freeImages.size() < freeImages.capacity()) freeImages.push_back(std::move(job.image));
+		busy = false;
+		if (!ok) failures++;
+		queueChanged.notify_all();
+	}
+}
+
+RGBImage ImageWriter::AcquireImage(const int width, const int height) {
+	std::lock_guard<std::mutex> lock(queueMutex);
+	while (!freeImages.empty()) {
+		RGBImage image = std::move(freeImages.back());
+		freeImages.pop_back();
+		if (image.width == width && image.height == height) return image;
+	}
+	return RGBImage(width, height);
+}
+
+void ImageWriter::Submit(RGBImage image) {
+	std::unique_lock<std::mutex> lock(queueMutex);
+	queueChanged.wait(lock, [this] { return queueCount < maxQueued; });
+	queue[(queueFront + queueCount) % maxQueued] = { std::move(image), submitted++ };
+	queueCount++;
+	queueChanged.notify_all();
+}
+
+void ImageWriter::Flush() {
+	std::unique_lock<std::mutex> lock(queueMutex);
+	queueChanged.wait(lock, [this] { return queueCount == 0 && !busy; });
+}
+
+int ImageWriter::GetFailures() {
+	std::lock_guard<std::mutex> lock(queueMutex);
+	return failures;
+}
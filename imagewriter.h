@@ -0,0 +1,105 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// 8-bit RGB pixels, row-major with row 0 at the bottom like the frame buffer
+struct RGBImage {
+	int width = 0, height = 0;
+	std::vector<std::uint8_t> data;
+
+	RGBImage() = default;
+	RGBImage(const int width, const int height) : width(width), height(height), data(width * height * 3) {}
+	std::uint8_t* GetRow(const int y) { return data.data() + y * width * 3; }
+	const std::uint8_t* GetRow(const int y) const { return data.data() + y * width * 3; }
+};
+
+// TGA is run-length encoded, PPM is binary P6, RAW is headerless top-down RGB24 (ffmpeg rawvideo rgb24).
+// PNG is stored uncompressed unless built with QS_ZLIB
+enum class ImageFormat { TGA, PPM, PNG, RAW };
+
+// Format from the file extension, TGA when it isn't recognized
+ImageFormat GetImageFormat(const std::string filename);
+void EncodeImage(const RGBImage& image, const ImageFormat format, std::vector<std::uint8_t>& out);
+// Encode in memory, then write the file with a single call
+bool WriteImage(const RGBImage& image, const std::string filename);
+
+// Destination of rendered frames, called in frame order from the ImageWriter's thread
+class FrameSink {
+public :
+	virtual ~FrameSink() = default;
+	virtual bool Write(const RGBImage& image, const int frame) = 0;
+};
+
+// One file per frame, e.g. output.tga or output_0000.png ... in batch mode
+class FileSink : public FrameSink {
+	std::string name;
+	std::string extension;
+	bool numbered;
+	std::vector<std::uint8_t> encoded;
+
+public :
+	// Writes name.extension, or name_NNNN.extension with the frame number when numbered.
+	// The extension picks the format, the names are never used as printf formats
+	FileSink(const std::string name, const std::string extension, const bool numbered = false);
+	bool Write(const RGBImage& image, const int frame) override;
+};
+
+// Raw RGB24 frames back to back, top row first, on stdout ("-") or a file or named pipe.
+// Matches ffmpeg -f rawvideo -pixel_format rgb24 -video_size WxH -i <path>
+class StreamSink : public FrameSink {
+	std::FILE* stream;
+	bool ownsStream;
+	std::vector<std::uint8_t> encoded;
+
+public :
+	explicit StreamSink(const std::string path);
+	~StreamSink() override;
+	bool IsOpen() const;
+	bool Write(const RGBImage& image, const int frame) override;
+};
+
+// Hands images to a sink on a background thread. Submit only blocks while maxQueued images are
+// waiting, so encoding and I/O overlap with rendering the next frame. Written images are kept
+// for AcquireImage, a steady stream of frames reuses the same few buffers
+class ImageWriter {
+	struct Job {
+		RGBImage image;
+		int frame;
+	};
+
+	std::unique_ptr<FrameSink> sink;
+	// Ring of maxQueued jobs
+	std::vector<Job> queue;
+	int queueFront = 0, queueCount = 0;
+	std::vector<RGBImage> freeImages;
+	std::mutex queueMutex;
+	std::condition_variable queueChanged;
+	std::thread worker;
+	int maxQueued;
+	int submitted = 0;
+	bool busy = false;
+	bool stopping = false;
+	int failures = 0;
+
+	void WorkerMain();
+
+public :
+	explicit ImageWriter(std::unique_ptr<FrameSink> sink, const int maxQueued = 2);
+	~ImageWriter();
+	ImageWriter(const ImageWriter&) = delete;
+	ImageWriter& operator=(const ImageWriter&) = delete;
+
+	// An image of the given size, recycled from the written ones when one fits
+	RGBImage AcquireImage(const int width, const int height);
+	void Submit(RGBImage image);
+	// Wait until every submitted image is written
+	void Flush();
+	int GetFailures();
+};
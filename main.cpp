@@ -1,20 +1,95 @@
 #include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <memory>
 #include "geometry.h"
 #include "renderer.h"
 #include "buffer.h"
 #include "camera.h"
 #include "light.h"
 #include "model.h"
+#include "imagewriter.h"
+#include "benchmark.h"
+#include "profiler.h"
+
+int main(int argc, char** argv) {
+	bool useMeshCache = false;
+	ShadingMode shadingMode = ShadingMode::FORWARD;
+	bool depthPrepass = false;
+	std::string defaultShader;
+	int orbitFrames = 0;
+	std::string cameraPathFile;
+	std::string instancesFile;
+	std::string format = "tga";
+	std::string streamPath;
+	int samples = 1;
+	int shadowMapSize = 0;
+	bool profile = false;
+	std::string traceFile;
+	bool benchmark = false;
+	BenchmarkOptions benchOptions;
+	for (int i = 1; i < argc; i++) {
+		if (!std::strcmp(argv[i], "--mesh-cache")) useMeshCache = true;
+		else if (!std::strcmp(argv[i], "--deferred")) shadingMode = ShadingMode::DEFERRED;
+		else if (!std::strcmp(argv[i], "--depth-prepass")) depthPrepass = true;
+		else if (!std::strcmp(argv[i], "--shader") && i + 1 < argc) defaultShader = argv[++i];
+		else if (!std::strcmp(argv[i], "--orbit") && i + 1 < argc) orbitFrames = std::atoi(argv[++i]);
+		else if (!std::strcmp(argv[i], "--camera-path") && i + 1 < argc) cameraPathFile = argv[++i];
+		else if (!std::strcmp(argv[i], "--instances") && i + 1 < argc) instancesFile = argv[++i];
+		else if (!std::strcmp(argv[i], "--format") && i + 1 < argc) format = argv[++i];
+		else if (!std::strcmp(argv[i], "--stream") && i + 1 < argc) streamPath = argv[++i];
+		else if (!std::strcmp(argv[i], "--msaa") && i + 1 < argc) samples = std::atoi(argv[++i]);
+		else if (!std::strcmp(argv[i], "--shadows")) shadowMapSize = 2048;
+		else if (!std::strcmp(argv[i], "--shadow-map-size") && i + 1 < argc) shadowMapSize = std::atoi(argv[++i]);
+		else if (!std::strcmp(argv[i], "--profile")) profile = true;
+		else if (!std::strcmp(argv[i], "--trace") && i + 1 < argc) traceFile = argv[++i];
+		else if (!std::strcmp(argv[i], "--bench")) benchmark = true;
+		else if (!std::strcmp(argv[i], "--bench-filter") && i + 1 < argc) benchOptions.filter = argv[++i];
+		else if (!std::strcmp(argv[i], "--bench-time") && i + 1 < argc) benchOptions.minSeconds = std::atof(argv[++i]);
+		else if (!std::strcmp(argv[i], "--bench-threads") && i + 1 < argc) benchOptions.threads.push_back(std::atoi(argv[++i]));
+		else if (!std::strcmp(argv[i], "--bench-assets") && i + 1 < argc) benchOptions.assetDir = argv[++i];
+	}
+
+	if (format != "tga" && format != "ppm" && format != "png" && format != "raw") {
+		std::cerr << "error: unknown format " << format << ", use tga, ppm, png or raw" << std::endl;
+		return 1;
+	}
+
+	// Benchmarks load the bundled assets themselves and print JSON to stdout
+	if (benchmark) return RunBenchmarks(benchOptions, std::cout) ? 0 : 1;
+
+	// Stage times and counters per frame, printed as one line each with --profile and kept for the trace with --trace
+	Profiler::SetThreadName("main");
+	Profiler::SetEnabled(profile || !traceFile.empty());
+	Profiler::SetTracing(!traceFile.empty());
+#if !QS_PROFILE
+	if (profile || !traceFile.empty()) std::cerr << "error: built with QS_NO_PROFILE, no stages or counters are recorded" << std::endl;
+#endif
 
-int main() {
 	std::vector<Model*> modelArray;
+	std::vector<std::string> shaderNames;
 
+	// A model path may end with #shader to pick its shader, e.g. diablo3pose.obj#bump
 	int n;
 	std::cin >> n;
 	for (int i = 0; i < n; i++) {
 		std::string modelName;
 		std::cin >> modelName;
-		modelArray.emplace_back(new Model(modelName));
+		size_t hash = modelName.find_last_of('#');
+		shaderNames.push_back(hash == std::string::npos ? defaultShader : modelName.substr(hash + 1));
+		modelArray.emplace_back(new Model(modelName.substr(0, hash), useMeshCache));
+	}
+
+	// Every model is drawn once per line of the instances file, sharing its mesh and textures
+	if (!instancesFile.empty()) {
+		std::vector<Model::Transform> instances;
+		if (!LoadInstances(instancesFile, instances)) {
+			std::cerr << "error: no instances in " << instancesFile << std::endl;
+			return 1;
+		}
+		for (Model* model : modelArray) model->SetInstances(instances);
 	}
 
 	std::string str = "try to rebuild my renderer";
@@ -22,8 +97,75 @@ int main() {
 	Camera camera(vec3(0.8, 0.8, 2.4), vec3(0, 0, 0));
 	Light light(vec3(1, 1, 1));
 
-	Renderer QsRenderer(camera, light, modelArray, 800, 800);
-	QsRenderer.RenderMainFun();
+	const int width = 800, height = 800;
+	Renderer QsRenderer(camera, light, modelArray, width, height);
+	QsRenderer.SetShadingMode(shadingMode);
+	QsRenderer.SetDepthPrepass(depthPrepass);
+	if (shadowMapSize > 0) QsRenderer.SetShadows(true, shadowMapSize);
+	if (!QsRenderer.SetSampleCount(samples)) {
+		std::cerr << "error: unsupported sample count " << samples << ", use 1, 2, 4 or 8" << std::endl;
+		return 1;
+	}
+	for (int i = 0; i < n; i++) {
+		if (shaderNames[i].empty() || QsRenderer.SetModelShader(*modelArray[i], shaderNames[i])) continue;
+		std::cerr << "error: unknown shader " << shaderNames[i] << ", available:";
+		for (const std::string& name : Renderer::GetShaderNames()) std::cerr << " " << name;
+		std::cerr << std::endl;
+	}
+
+	auto endFrame = [&]() {
+		FrameProfile frame = Profiler::EndFrame(width * height);
+		if (profile) std::cerr << frame.Summary() << std::endl;
+	};
+	auto printArena = [&]() {
+		const FrameArena& arena = QsRenderer.GetFrameArena();
+		std::cerr << "# frame arena high water " << arena.GetHighWater() / 1024 << " KiB, holding " << arena.GetCapacity() / 1024 << " KiB" << std::endl;
+	};
+
+	std::vector<Camera> cameraPath;
+	if (orbitFrames > 0) cameraPath = MakeOrbit(camera, orbitFrames);
+	else if (!cameraPathFile.empty() && !LoadCameraPath(cameraPathFile, camera, cameraPath)) {
+		std::cerr << "error: no cameras in " << cameraPathFile << std::endl;
+		return 1;
+	}
+
+	// Frames go to output.tga, output_NNNN.tga in batch mode, or back to back as raw RGB to a stream
+	if (!streamPath.empty()) {
+		std::unique_ptr<StreamSink> sink = std::make_unique<StreamSink>(streamPath);
+		if (!sink->IsOpen()) return 1;
+		QsRenderer.SetOutputSink(std::move(sink), 4);
+	}
+	else QsRenderer.SetOutputSink(std::make_unique<FileSink>("output", format, !cameraPath.empty()));
+
+	if (cameraPath.empty()) {
+		QsRenderer.RenderMainFun();
+		endFrame();
+		if (QsRenderer.FlushOutput()) std::cerr << "error: the frame was not written" << std::endl;
+		if (!traceFile.empty()) Profiler::WriteTrace(traceFile);
+
+		const RenderStats& stats = QsRenderer.GetStats();
+		std::cerr << "# models culled " << stats.modelsCulled << " meshlets frustum culled " << stats.meshletsFrustumCulled << " cone culled " << stats.meshletsConeCulled << std::endl;
+		std::cerr << "# faces " << stats.facesSubmitted << " frustum culled " << stats.frustumCulled << " backface culled " << stats.backfaceCulled
+			<< " small culled " << stats.smallCulled << " rasterized " << stats.trianglesRasterized << " hi-z culled " << stats.hiZCulled << std::endl;
+		printArena();
+		return 0;
+	}
+
+	// Batch mode: models, textures and buffers are reused across frames, and each frame is
+	// written on the output thread while the next one renders
+	auto start = std::chrono::steady_clock::now();
+	for (int frame = 0; frame < (int)cameraPath.size(); frame++) {
+		camera = cameraPath[frame];
+		QsRenderer.RenderMainFun();
+		endFrame();
+	}
+	int failures = QsRenderer.FlushOutput();
+	if (failures) std::cerr << "error: " << failures << " frames were not written" << std::endl;
+	if (!traceFile.empty()) Profiler::WriteTrace(traceFile);
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cerr << "# frames " << cameraPath.size() << " in " << seconds << " s, " << seconds * 1000 / cameraPath.size() << " ms per frame" << std::endl;
+	printArena();
 
 	return 0;
 }
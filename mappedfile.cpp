@@ -0,0 +1,93 @@
+#include "mappedfile.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(_WIN32)
+
+MappedFile::MappedFile(const std::string filename) {
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return;
+	fileHandle = file;
+
+	LARGE_INTEGER fileSize;
+	FILETIME writeTime;
+	if (!GetFileSizeEx(file, &fileSize) || !GetFileTime(file, nullptr, nullptr, &writeTime)) return;
+	size = (std::size_t)fileSize.QuadPart;
+	modifiedTime = ((std::uint64_t)writeTime.dwHighDateTime << 32) | writeTime.dwLowDateTime;
+
+	// Empty files cannot be mapped, but are valid
+	if (size > 0) {
+		mappingHandle = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!mappingHandle) return;
+		data = (const char*)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+		if (!data) return;
+	}
+	opened = true;
+}
+
+MappedFile::~MappedFile() {
+	if (data) UnmapViewOfFile(data);
+	if (mappingHandle) CloseHandle(mappingHandle);
+	if (fileHandle) CloseHandle(fileHandle);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string filename) {
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) return;
+
+	struct stat st;
+	if (fstat(fd, &st) == 0) {
+		size = (std::size_t)st.st_size;
+		// Nanoseconds where the stat has them, an edit within the same second still changes it
+#if defined(__APPLE__)
+		modifiedTime = (std::uint64_t)st.st_mtimespec.tv_sec * 1000000000 + (std::uint64_t)st.st_mtimespec.tv_nsec;
+#else
+		modifiedTime = (std::uint64_t)st.st_mtim.tv_sec * 1000000000 + (std::uint64_t)st.st_mtim.tv_nsec;
+#endif
+		if (size == 0) {
+			opened = true;
+		}
+		else {
+			void* ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (ptr != MAP_FAILED) {
+				data = (const char*)ptr;
+				opened = true;
+			}
+		}
+	}
+	// The mapping stays valid after the descriptor is closed
+	close(fd);
+}
+
+MappedFile::~MappedFile() {
+	if (data) munmap((void*)data, size);
+}
+
+#endif
+
+bool MappedFile::IsOpen() const {
+	return opened;
+}
+
+const char* MappedFile::GetData() const {
+	return data;
+}
+
+std::size_t MappedFile::GetSize() const {
+	return size;
+}
+
+std::uint64_t MappedFile::GetModifiedTime() const {
+	return modifiedTime;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+	const char* data = nullptr;
+	std::size_t size = 0;
+	std::uint64_t modifiedTime = 0;
+	bool opened = false;
+
+#if defined(_WIN32)
+	void* fileHandle = nullptr;
+	void* mappingHandle = nullptr;
+#endif
+
+public :
+	MappedFile(const std::string filename);
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool IsOpen() const;
+	const char* GetData() const;
+	std::size_t GetSize() const;
+	// Opaque last-write timestamp at the file system's resolution, only meaningful for comparing
+	// two reads of the same file
+	std::uint64_t GetModifiedTime() const;
+};
@@ -1,100 +1,809 @@
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <cstring>
+#include <cmath>
 #include <sstream>
 #include "model.h"
+#include "mappedfile.h"
 
-Model::Model(const std::string filename) : filename(filename) {
-	std::ifstream in;
-	in.open(filename, std::ifstream::in);
-	if (in.fail()) return;
-	std::string line;
-	while (!in.eof()) {
-		std::getline(in, line);
-		std::istringstream iss(line.c_str());
-		char trash;
-		if (!line.compare(0, 2, "v ")) {
-			iss >> trash;
-			vec3 v;
-			for (int i = 0; i < 3; i++) iss >> v[i];
-			verts.push_back(v);
-		}
-		else if (!line.compare(0, 3, "vn ")) {
-			iss >> trash >> trash;
-			vec3 n;
-			for (int i = 0; i < 3; i++) iss >> n[i];
-			norms.push_back(n.normalize());
-		}
-		else if (!line.compare(0, 3, "vt ")) {
-			iss >> trash >> trash;
-			vec2 uv;
-			for (int i = 0; i < 2; i++) iss >> uv[i];
-			tex_coord.push_back({ uv.x, 1 - uv.y });
-		}
-		else if (!line.compare(0, 2, "f ")) {
-			int f, t, n;
-			iss >> trash;
-			int cnt = 0;
-			while (iss >> f >> trash >> t >> trash >> n) {
-				facet_vrt.push_back(--f);
-				facet_tex.push_back(--t);
-				facet_nrm.push_back(--n);
-				cnt++;
+// Binary mesh cache layout: header, then the welded vertices, the index buffer and the face count of each meshlet
+#pragma pack(push,1)
+struct MeshCacheHeader {
+	char magic[4];
+	std::uint32_t version;
+	std::uint64_t sourceSize;
+	std::uint64_t sourceTime;
+	std::uint32_t optimized;
+	std::uint32_t nverts, nfaces, nmeshlets;
+};
+#pragma pack(pop)
+
+static const char MESH_CACHE_MAGIC[4] = { 'Q', 'S', 'M', 'S' };
+static const std::uint32_t MESH_CACHE_VERSION = 3;
+
+// Separate attribute streams and index triples as they come out of the obj file
+struct ObjData {
+	std::vector<vec3> verts;
+	std::vector<vec2> tex_coord;
+	std::vector<vec3> norms;
+	std::vector<int> facet_vrt;
+	std::vector<int> facet_tex;
+	std::vector<int> facet_nrm;
+};
+
+// Lines of one chunk of the obj file, with the element counts found by the first pass
+struct ObjChunk {
+	const char* begin;
+	const char* end;
+	int nverts, ntexcoords, nnorms, nfaces;
+};
+
+static bool IsSpace(const char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char* SkipSpaces(const char* p, const char* end) {
+	while (p < end && IsSpace(*p)) p++;
+	return p;
+}
+
+static const char* NextLine(const char* p, const char* end) {
+	const char* eol = (const char*)std::memchr(p, '\n', end - p);
+	return eol ? eol + 1 : end;
+}
+
+static const char* ParseInt(const char* p, const char* end, int& out) {
+	bool neg = false;
+	if (p < end && (*p == '-' || *p == '+')) neg = *p++ == '-';
+	int val = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; p++) val = val * 10 + (*p - '0');
+	out = neg ? -val : val;
+	return p;
+}
+
+static const char* ParseFloat(const char* p, const char* end, float& out) {
+	static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+	p = SkipSpaces(p, end);
+	bool neg = false;
+	if (p < end && (*p == '-' || *p == '+')) neg = *p++ == '-';
+
+	// Up to 19 significant digits fit the mantissa, the rest only moves the exponent
+	std::uint64_t mantissa = 0;
+	int digits = 0, exponent = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; p++) {
+		if (digits < 19) {
+			mantissa = mantissa * 10 + (*p - '0');
+			if (mantissa) digits++;
+		}
+		else {
+			exponent++;
+		}
+	}
+	if (p < end && *p == '.') {
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+			if (digits < 19) {
+				mantissa = mantissa * 10 + (*p - '0');
+				if (mantissa) digits++;
+				exponent--;
+			}
+		}
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		int e;
+		p = ParseInt(p + 1, end, e);
+		exponent += e;
+	}
+
+	double val = (double)mantissa;
+	if (exponent < 0) val = -exponent <= 22 ? val / pow10[-exponent] : val * std::pow(10.0, exponent);
+	else if (exponent > 0) val = exponent <= 22 ? val * pow10[exponent] : val * std::pow(10.0, exponent);
+	out = (float)(neg ? -val : val);
+	return p;
+}
+
+// Counts the vertices of an "f" line, fan triangulation turns n of them into n - 2 triangles
+static int CountFaceVertices(const char* p, const char* end) {
+	int cnt = 0;
+	while (true) {
+		p = SkipSpaces(p, end);
+		if (p >= end || *p == '\n' || *p == '#') return cnt;
+		cnt++;
+		while (p < end && !IsSpace(*p) && *p != '\n') p++;
+	}
+}
+
+// One obj index triple, -1 where the attribute is missing
+static const char* ParseFaceVertex(const char* p, const char* end, const int counts[3], int out[3]) {
+	for (int k = 0; k < 3; k++) {
+		int idx = 0;
+		if (p < end && *p != '/' && !IsSpace(*p) && *p != '\n') p = ParseInt(p, end, idx);
+		// Positive indices are 1-based, negative ones count back from the latest element
+		out[k] = idx > 0 ? idx - 1 : (idx < 0 ? counts[k] + idx : -1);
+		if (k < 2) {
+			if (p < end && *p == '/') p++;
+			else {
+				out[k + 1] = -1;
+				if (k == 0) out[2] = -1;
+				break;
+			}
+		}
+	}
+	while (p < end && !IsSpace(*p) && *p != '\n') p++;
+	return p;
+}
+
+static void CountObjChunk(ObjChunk& chunk) {
+	chunk.nverts = chunk.ntexcoords = chunk.nnorms = chunk.nfaces = 0;
+	for (const char* line = chunk.begin; line < chunk.end; line = NextLine(line, chunk.end)) {
+		const char* p = SkipSpaces(line, chunk.end);
+		if (chunk.end - p < 2) continue;
+		if (p[0] == 'v' && IsSpace(p[1])) chunk.nverts++;
+		else if (p[0] == 'v' && p[1] == 't') chunk.ntexcoords++;
+		else if (p[0] == 'v' && p[1] == 'n') chunk.nnorms++;
+		else if (p[0] == 'f' && IsSpace(p[1])) chunk.nfaces += std::max(CountFaceVertices(p + 1, chunk.end) - 2, 0);
+	}
+}
+
+// Faces without uv get a shared (0, 0), faces without normals get their flat face normal
+static void FillMissingAttributes(ObjData& obj) {
+	int nfaces = (int)obj.facet_vrt.size() / 3;
+	int defaultTex = -1;
+	for (int i = 0; i < nfaces; i++) {
+		for (int j = 0; j < 3; j++) {
+			int& t = obj.facet_tex[i * 3 + j];
+			if (t >= 0 && t < (int)obj.tex_coord.size()) continue;
+			if (defaultTex < 0) {
+				defaultTex = (int)obj.tex_coord.size();
+				obj.tex_coord.push_back({ 0, 0 });
+			}
+			t = defaultTex;
+		}
+
+		bool missingNormal = false;
+		for (int j = 0; j < 3; j++) {
+			int n = obj.facet_nrm[i * 3 + j];
+			missingNormal = missingNormal || n < 0 || n >= (int)obj.norms.size();
+		}
+		if (!missingNormal) continue;
+		const vec3* v[3] = { &obj.verts[obj.facet_vrt[i * 3]], &obj.verts[obj.facet_vrt[i * 3 + 1]], &obj.verts[obj.facet_vrt[i * 3 + 2]] };
+		vec3 faceNormal = cross(*v[1] - *v[0], *v[2] - *v[0]);
+		obj.norms.push_back(faceNormal.norm() > 0 ? faceNormal.normalize() : vec3(0, 0, 1));
+		for (int j = 0; j < 3; j++) obj.facet_nrm[i * 3 + j] = (int)obj.norms.size() - 1;
+	}
+}
+
+// Faces referencing a position the file doesn't define, missing or resolved out of range, are
+// dropped with a warning. Bad uv and normal indices are fixed up by FillMissingAttributes
+static void DropInvalidFaces(ObjData& obj) {
+	int nfaces = (int)obj.facet_vrt.size() / 3;
+	int nverts = (int)obj.verts.size();
+	int kept = 0;
+	for (int i = 0; i < nfaces; i++) {
+		bool valid = true;
+		for (int j = 0; j < 3; j++) {
+			int v = obj.facet_vrt[i * 3 + j];
+			valid = valid && v >= 0 && v < nverts;
+		}
+		if (!valid) continue;
+		for (int j = 0; j < 3; j++) {
+			obj.facet_vrt[kept * 3 + j] = obj.facet_vrt[i * 3 + j];
+			obj.facet_tex[kept * 3 + j] = obj.facet_tex[i * 3 + j];
+			obj.facet_nrm[kept * 3 + j] = obj.facet_nrm[i * 3 + j];
+		}
+		kept++;
+	}
+	if (kept == nfaces) return;
+	std::cerr << "warning: dropped " << nfaces - kept << " faces with a vertex index out of range" << std::endl;
+	obj.facet_vrt.resize(kept * 3);
+	obj.facet_tex.resize(kept * 3);
+	obj.facet_nrm.resize(kept * 3);
+}
+
+static void ParseObj(const char* data, const std::size_t size, ObjData& obj) {
+	const std::size_t CHUNK_SIZE = 1 << 20;
+	const char* end = data + size;
+
+	// Split at line boundaries so each chunk can be parsed on its own
+	std::vector<ObjChunk> chunks;
+	for (const char* p = data; p < end;) {
+		const char* chunkEnd = (std::size_t)(end - p) > CHUNK_SIZE ? NextLine(p + CHUNK_SIZE, end) : end;
+		chunks.push_back({ p, chunkEnd, 0, 0, 0, 0 });
+		p = chunkEnd;
+	}
+	int nchunks = (int)chunks.size();
+
+#pragma omp parallel for schedule(dynamic)
+	for (int c = 0; c < nchunks; c++) {
+		CountObjChunk(chunks[c]);
+	}
+
+	// Prefix sums give every chunk the offsets it writes its elements at
+	std::vector<ObjChunk> offsets(nchunks);
+	ObjChunk total = { nullptr, nullptr, 0, 0, 0, 0 };
+	for (int c = 0; c < nchunks; c++) {
+		offsets[c] = total;
+		total.nverts += chunks[c].nverts;
+		total.ntexcoords += chunks[c].ntexcoords;
+		total.nnorms += chunks[c].nnorms;
+		total.nfaces += chunks[c].nfaces;
+	}
+	obj.verts.resize(total.nverts);
+	obj.tex_coord.resize(total.ntexcoords);
+	obj.norms.resize(total.nnorms);
+	obj.facet_vrt.resize(total.nfaces * 3);
+	obj.facet_tex.resize(total.nfaces * 3);
+	obj.facet_nrm.resize(total.nfaces * 3);
+
+#pragma omp parallel for schedule(dynamic)
+	for (int c = 0; c < nchunks; c++) {
+		int counts[3] = { offsets[c].nverts, offsets[c].ntexcoords, offsets[c].nnorms };
+		int iface = offsets[c].nfaces;
+		std::vector<int> polygon;
+
+		for (const char* line = chunks[c].begin; line < chunks[c].end; line = NextLine(line, chunks[c].end)) {
+			const char* p = SkipSpaces(line, chunks[c].end);
+			if (chunks[c].end - p < 2) continue;
+
+			if (p[0] == 'v' && IsSpace(p[1])) {
+				vec3& v = obj.verts[counts[0]++];
+				p = ParseFloat(p + 1, end, v.x);
+				p = ParseFloat(p, end, v.y);
+				p = ParseFloat(p, end, v.z);
+			}
+			else if (p[0] == 'v' && p[1] == 't') {
+				vec2 uv;
+				p = ParseFloat(p + 2, end, uv.x);
+				p = ParseFloat(p, end, uv.y);
+				obj.tex_coord[counts[1]++] = { uv.x, 1 - uv.y };
+			}
+			else if (p[0] == 'v' && p[1] == 'n') {
+				vec3 n;
+				p = ParseFloat(p + 2, end, n.x);
+				p = ParseFloat(p, end, n.y);
+				p = ParseFloat(p, end, n.z);
+				obj.norms[counts[2]++] = n.normalize();
+			}
+			else if (p[0] == 'f' && IsSpace(p[1])) {
+				polygon.clear();
+				p++;
+				while (true) {
+					p = SkipSpaces(p, end);
+					if (p >= end || *p == '\n' || *p == '#') break;
+					int idx[3];
+					p = ParseFaceVertex(p, end, counts, idx);
+					polygon.insert(polygon.end(), idx, idx + 3);
+				}
+				// Fan triangulation
+				int n = (int)polygon.size() / 3;
+				for (int k = 1; k + 1 < n; k++, iface++) {
+					const int corner[3] = { 0, k, k + 1 };
+					for (int j = 0; j < 3; j++) {
+						obj.facet_vrt[iface * 3 + j] = polygon[corner[j] * 3];
+						obj.facet_tex[iface * 3 + j] = polygon[corner[j] * 3 + 1];
+						obj.facet_nrm[iface * 3 + j] = polygon[corner[j] * 3 + 2];
+					}
+				}
+			}
+		}
+	}
+
+	DropInvalidFaces(obj);
+	FillMissingAttributes(obj);
+}
+
+// Weld identical (position, uv, normal) triples, chaining the candidates of each position
+void Model::BuildVertexBuffer(const ObjData& obj) {
+	int nindices = (int)obj.facet_vrt.size();
+	std::vector<int> firstWelded(obj.verts.size(), -1);
+	std::vector<int> nextWelded, vertTex, vertNrm;
+	vertices.clear();
+	indices.resize(nindices);
+
+	for (int i = 0; i < nindices; i++) {
+		int v = obj.facet_vrt[i], t = obj.facet_tex[i], n = obj.facet_nrm[i];
+		int found = -1;
+		for (int k = firstWelded[v]; k >= 0; k = nextWelded[k]) {
+			if (vertTex[k] == t && vertNrm[k] == n) {
+				found = k;
+				break;
+			}
+		}
+		if (found < 0) {
+			found = (int)vertices.size();
+			vertices.push_back({ obj.verts[v], obj.tex_coord[t], obj.norms[n] });
+			vertTex.push_back(t);
+			vertNrm.push_back(n);
+			nextWelded.push_back(firstWelded[v]);
+			firstWelded[v] = found;
+		}
+		indices[i] = (std::uint32_t)found;
+	}
+}
+
+// Forsyth's linear-speed vertex cache optimisation: greedily emit the triangle whose vertices
+// score highest in a simulated LRU cache, favouring vertices with few remaining triangles.
+// Indices must be below nverts
+static void OptimizeVertexCache(std::vector<std::uint32_t>& indices, const int nverts) {
+	const int CACHE_SIZE = 32;
+	const float LAST_TRI_SCORE = 0.75f, DECAY_POWER = 1.5f, VALENCE_SCALE = 2.f, VALENCE_POWER = 0.5f;
+
+	int nfaces = (int)indices.size() / 3;
+	if (nfaces == 0) return;
+
+	// Triangles adjacent to each vertex, compressed into one array
+	std::vector<int> remaining(nverts, 0), adjOffset(nverts + 1, 0), adjacency(indices.size());
+	for (std::uint32_t idx : indices) remaining[idx]++;
+	for (int v = 0; v < nverts; v++) adjOffset[v + 1] = adjOffset[v] + remaining[v];
+	std::vector<int> fill(adjOffset.begin(), adjOffset.end() - 1);
+	for (int i = 0; i < (int)indices.size(); i++) adjacency[fill[indices[i]]++] = i / 3;
+
+	auto vertexScore = [&](int cachePos, int valence) {
+		if (valence == 0) return -1.f;
+		float score = 0;
+		if (cachePos >= 0) {
+			if (cachePos < 3) score = LAST_TRI_SCORE;
+			else score = std::pow(1.f - (cachePos - 3) / float(CACHE_SIZE - 3), DECAY_POWER);
+		}
+		return score + VALENCE_SCALE * std::pow(float(valence), -VALENCE_POWER);
+	};
+
+	std::vector<int> cachePos(nverts, -1);
+	std::vector<float> vertScore(nverts), triScore(nfaces, 0);
+	std::vector<bool> emitted(nfaces, false);
+	for (int v = 0; v < nverts; v++) vertScore[v] = vertexScore(-1, remaining[v]);
+	for (int f = 0; f < nfaces; f++)
+		for (int j = 0; j < 3; j++) triScore[f] += vertScore[indices[f * 3 + j]];
+
+	std::vector<std::uint32_t> out;
+	out.reserve(indices.size());
+	std::vector<int> cache, nextCache;
+	int bestTri = (int)(std::max_element(triScore.begin(), triScore.end()) - triScore.begin());
+	int scanPos = 0;
+	while (bestTri >= 0) {
+		emitted[bestTri] = true;
+		nextCache.clear();
+		for (int j = 0; j < 3; j++) {
+			int v = indices[bestTri * 3 + j];
+			out.push_back(v);
+			nextCache.push_back(v);
+			// Drop the emitted triangle from the vertex's adjacency list
+			int* begin = &adjacency[adjOffset[v]];
+			int* end = begin + remaining[v];
+			std::iter_swap(std::find(begin, end, bestTri), end - 1);
+			remaining[v]--;
+		}
+		for (int v : cache)
+			if (v != (int)nextCache[0] && v != (int)nextCache[1] && v != (int)nextCache[2]) nextCache.push_back(v);
+		std::swap(cache, nextCache);
+
+		// Rescore vertices that were or are in the cache along with their triangles
+		for (int i = 0; i < (int)cache.size(); i++) {
+			int v = cache[i];
+			cachePos[v] = i < CACHE_SIZE ? i : -1;
+			float score = vertexScore(cachePos[v], remaining[v]);
+			float delta = score - vertScore[v];
+			vertScore[v] = score;
+			for (int k = adjOffset[v]; k < adjOffset[v] + remaining[v]; k++) triScore[adjacency[k]] += delta;
+		}
+		if ((int)cache.size() > CACHE_SIZE) cache.resize(CACHE_SIZE);
+
+		bestTri = -1;
+		float bestScore = -1;
+		for (int v : cache) {
+			for (int k = adjOffset[v]; k < adjOffset[v] + remaining[v]; k++) {
+				int f = adjacency[k];
+				if (triScore[f] > bestScore) {
+					bestScore = triScore[f];
+					bestTri = f;
+				}
 			}
-			if (3 != cnt) {
-				std::cerr << "Error: the obj file is supposed to be triangulated" << std::endl;
-				in.close();
-				return;
+		}
+		// Nothing adjacent to the cache left: continue with the next unemitted triangle
+		if (bestTri < 0) {
+			while (scanPos < nfaces && emitted[scanPos]) scanPos++;
+			if (scanPos < nfaces) bestTri = scanPos;
+		}
+	}
+	indices.swap(out);
+}
+
+void Model::OptimizeVertexCache() {
+	::OptimizeVertexCache(indices, (int)vertices.size());
+}
+
+// Renumber vertices in order of first use so the index stream walks memory forwards
+void Model::OptimizeVertexFetch() {
+	std::vector<int> remap(vertices.size(), -1);
+	std::vector<Vertex> reordered;
+	reordered.reserve(vertices.size());
+	for (std::uint32_t& idx : indices) {
+		if (remap[idx] < 0) {
+			remap[idx] = (int)reordered.size();
+			reordered.push_back(vertices[idx]);
+		}
+		idx = (std::uint32_t)remap[idx];
+	}
+	vertices.swap(reordered);
+}
+
+// Group the faces into meshlets and reorder the index buffer so each meshlet is a run of faces.
+// A meshlet grows from the first unused face over faces sharing its vertices, preferring those that
+// add few vertices and face the same way, so that its bounds and normal cone stay tight.
+// Returns the number of faces of each meshlet
+std::vector<int> Model::BuildMeshlets(const bool optimize) {
+	std::vector<int> meshletFaces;
+	int nfaces = GetNumberOfFaces(), nverts = GetNumberOfVertices();
+	std::vector<vec3> faceNormals(nfaces);
+	for (int f = 0; f < nfaces; f++) {
+		vec3 v0 = GetVert(f, 0);
+		vec3 n = cross(GetVert(f, 1) - v0, GetVert(f, 2) - v0);
+		float len = n.norm();
+		faceNormals[f] = len > 0 ? n / len : vec3(0, 0, 0);
+	}
+
+	// Faces around each vertex
+	std::vector<int> adjacencyStart(nverts + 1, 0), adjacency(indices.size());
+	for (std::uint32_t idx : indices) adjacencyStart[idx + 1]++;
+	for (int i = 0; i < nverts; i++) adjacencyStart[i + 1] += adjacencyStart[i];
+	std::vector<int> fill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+	for (int f = 0; f < nfaces; f++) {
+		for (int j = 0; j < 3; j++) adjacency[fill[indices[f * 3 + j]]++] = f;
+	}
+
+	// Meshlet that last took each vertex
+	std::vector<int> owner(nverts, -1);
+	std::vector<bool> used(nfaces);
+	std::vector<int> order, candidates, faces;
+	order.reserve(nfaces);
+	int seed = 0;
+	while (true) {
+		while (seed < nfaces && used[seed]) seed++;
+		if (seed == nfaces) break;
+
+		int id = (int)meshletFaces.size();
+		int vertexCount = 0;
+		vec3 normalSum(0, 0, 0);
+		faces.clear();
+		candidates.clear();
+		int next = seed;
+		while (next >= 0) {
+			used[next] = true;
+			faces.push_back(next);
+			normalSum = normalSum + faceNormals[next];
+			for (int j = 0; j < 3; j++) {
+				std::uint32_t idx = indices[next * 3 + j];
+				if (owner[idx] == id) continue;
+				owner[idx] = id;
+				vertexCount++;
+				for (int a = adjacencyStart[idx]; a < adjacencyStart[idx + 1]; a++) {
+					if (!used[adjacency[a]]) candidates.push_back(adjacency[a]);
+				}
+			}
+			if ((int)faces.size() == MESHLET_MAX_FACES) break;
+
+			// Cheapest candidate that still fits: each new vertex costs 1, and facing away from
+			// the meshlet's mean normal up to 8 more, which keeps the normal cone narrow
+			next = -1;
+			float best = 1e30f, normalLen = normalSum.norm();
+			for (int k = 0; k < (int)candidates.size();) {
+				int f = candidates[k];
+				if (used[f]) {
+					candidates[k] = candidates.back();
+					candidates.pop_back();
+					continue;
+				}
+				k++;
+				int added = 0;
+				for (int j = 0; j < 3; j++) added += owner[indices[f * 3 + j]] != id;
+				if (vertexCount + added > MESHLET_MAX_VERTICES) continue;
+				float facing = normalLen > 0 ? faceNormals[f] * normalSum / normalLen : 1;
+				float cost = added + 4 * (1 - facing);
+				if (cost < best || (cost == best && f < next)) {
+					best = cost;
+					next = f;
+				}
+			}
+		}
+
+		std::sort(faces.begin(), faces.end());
+		order.insert(order.end(), faces.begin(), faces.end());
+		meshletFaces.push_back((int)faces.size());
+	}
+
+	std::vector<std::uint32_t> reordered(indices.size());
+	for (int f = 0; f < nfaces; f++) {
+		for (int j = 0; j < 3; j++) reordered[f * 3 + j] = indices[order[f] * 3 + j];
+	}
+	indices.swap(reordered);
+
+	// Restore the cache order inside each meshlet, over its own vertex numbering
+	if (!optimize) return meshletFaces;
+	int first = 0;
+	std::vector<int> local(nverts, -1);
+	std::vector<std::uint32_t> global, meshletIndices;
+	for (int count : meshletFaces) {
+		global.clear();
+		meshletIndices.assign(indices.begin() + first * 3, indices.begin() + (first + count) * 3);
+		for (std::uint32_t& idx : meshletIndices) {
+			if (local[idx] < 0) {
+				local[idx] = (int)global.size();
+				global.push_back(idx);
 			}
+			idx = local[idx];
 		}
+		::OptimizeVertexCache(meshletIndices, (int)global.size());
+		for (int i = 0; i < count * 3; i++) indices[first * 3 + i] = global[meshletIndices[i]];
+		for (std::uint32_t idx : global) local[idx] = -1;
+		first += count;
 	}
-	in.close();
-	std::cerr << "# v# " << GetNumberOfVertices() << " f# " << GetNumberOfFaces() << " vt# " << tex_coord.size() << " vn# " << norms.size() << std::endl;
+
+	return meshletFaces;
+}
+
+// Vertex lists, bounding spheres and normal cones of meshlets with the given face counts
+void Model::ComputeMeshletBounds(const std::vector<int>& meshletFaces) {
+	boundsMin = vec3(1e30f, 1e30f, 1e30f);
+	boundsMax = vec3(-1e30f, -1e30f, -1e30f);
+	for (const Vertex& v : vertices) {
+		for (int k = 0; k < 3; k++) {
+			boundsMin[k] = std::min(boundsMin[k], v.pos[k]);
+			boundsMax[k] = std::max(boundsMax[k], v.pos[k]);
+		}
+	}
+
+	meshlets.clear();
+	meshletVertices.clear();
+	std::vector<int> owner(vertices.size(), -1);
+	int first = 0;
+	for (int count : meshletFaces) {
+		Meshlet m{};
+		m.firstFace = first;
+		m.faceCount = count;
+		m.firstVertex = (int)meshletVertices.size();
+		for (int i = first * 3; i < (first + count) * 3; i++) {
+			if (owner[indices[i]] == (int)meshlets.size()) continue;
+			owner[indices[i]] = (int)meshlets.size();
+			meshletVertices.push_back(indices[i]);
+			m.vertexCount++;
+		}
+		meshlets.push_back(m);
+		first += count;
+	}
+
+	for (Meshlet& m : meshlets) {
+		vec3 lo(1e30f, 1e30f, 1e30f), hi(-1e30f, -1e30f, -1e30f);
+		for (int i = 0; i < m.vertexCount; i++) {
+			vec3 p = vertices[meshletVertices[m.firstVertex + i]].pos;
+			for (int k = 0; k < 3; k++) {
+				lo[k] = std::min(lo[k], p[k]);
+				hi[k] = std::max(hi[k], p[k]);
+			}
+		}
+		m.center = (lo + hi) * 0.5f;
+		m.radius = 0;
+		for (int i = 0; i < m.vertexCount; i++) m.radius = std::max(m.radius, (vertices[meshletVertices[m.firstVertex + i]].pos - m.center).norm());
+
+		// The axis is the mean face normal, the cutoff comes from the normal farthest from it
+		std::vector<vec3> normals;
+		vec3 axis(0, 0, 0);
+		for (int f = m.firstFace; f < m.firstFace + m.faceCount; f++) {
+			vec3 v0 = GetVert(f, 0);
+			vec3 n = cross(GetVert(f, 1) - v0, GetVert(f, 2) - v0);
+			float len = n.norm();
+			if (len == 0) continue;
+			normals.push_back(n / len);
+			axis = axis + normals.back();
+		}
+		m.coneAxis = vec3(0, 0, 1);
+		m.coneCutoff = 1;
+		float axisLen = axis.norm();
+		if (axisLen < 1e-6f) continue;
+		axis = axis / axisLen;
+		float minDot = 1;
+		for (const vec3& n : normals) minDot = std::min(minDot, n * axis);
+		if (minDot <= 0) continue;
+		m.coneAxis = axis;
+		m.coneCutoff = std::sqrt(1 - minDot * minDot);
+	}
+}
+
+bool Model::LoadMeshCache(const std::string cachefile, const std::uint64_t sourceSize, const std::uint64_t sourceTime, const bool optimize, std::vector<int>& meshletFaces) {
+	MappedFile cache(cachefile);
+	if (!cache.IsOpen() || cache.GetSize() < sizeof(MeshCacheHeader)) return false;
+
+	MeshCacheHeader header;
+	std::memcpy(&header, cache.GetData(), sizeof(header));
+	if (std::memcmp(header.magic, MESH_CACHE_MAGIC, 4) || header.version != MESH_CACHE_VERSION) return false;
+	if (header.sourceSize != sourceSize || header.sourceTime != sourceTime) return false;
+	if (header.optimized != (optimize ? 1u : 0u)) return false;
+	std::size_t expected = sizeof(header) + header.nverts * sizeof(Vertex) + header.nfaces * sizeof(std::uint32_t) * 3 + header.nmeshlets * sizeof(std::uint32_t);
+	if (cache.GetSize() != expected) return false;
+
+	const char* p = cache.GetData() + sizeof(header);
+	vertices.resize(header.nverts);
+	std::memcpy(vertices.data(), p, header.nverts * sizeof(Vertex));
+	p += header.nverts * sizeof(Vertex);
+	indices.resize(header.nfaces * 3);
+	std::memcpy(indices.data(), p, indices.size() * sizeof(std::uint32_t));
+	p += indices.size() * sizeof(std::uint32_t);
+	std::vector<std::uint32_t> faceCounts(header.nmeshlets);
+	std::memcpy(faceCounts.data(), p, faceCounts.size() * sizeof(std::uint32_t));
+
+	// A cache of the right size can still be stale or corrupt, the meshlets have to cover the
+	// faces exactly and every index has to name a vertex, or the mesh is rebuilt from the obj
+	std::uint64_t meshletFaceSum = 0;
+	for (std::uint32_t count : faceCounts) meshletFaceSum += count;
+	if (meshletFaceSum != header.nfaces) return false;
+	for (std::uint32_t index : indices) {
+		if (index >= header.nverts) return false;
+	}
+	meshletFaces.assign(faceCounts.begin(), faceCounts.end());
+	return true;
+}
+
+void Model::SaveMeshCache(const std::string cachefile, const std::uint64_t sourceSize, const std::uint64_t sourceTime, const bool optimize, const std::vector<int>& meshletFaces) const {
+	std::ofstream out(cachefile, std::ios::binary);
+	if (!out.is_open()) {
+		std::cerr << "can't write mesh cache " << cachefile << std::endl;
+		return;
+	}
+	MeshCacheHeader header;
+	std::memcpy(header.magic, MESH_CACHE_MAGIC, 4);
+	header.version = MESH_CACHE_VERSION;
+	header.sourceSize = sourceSize;
+	header.sourceTime = sourceTime;
+	header.optimized = optimize ? 1 : 0;
+	header.nverts = (std::uint32_t)vertices.size();
+	header.nfaces = (std::uint32_t)GetNumberOfFaces();
+	header.nmeshlets = (std::uint32_t)meshletFaces.size();
+
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(vertices.data()), vertices.size() * sizeof(Vertex));
+	out.write(reinterpret_cast<const char*>(indices.data()), indices.size() * sizeof(std::uint32_t));
+	std::vector<std::uint32_t> faceCounts(meshletFaces.begin(), meshletFaces.end());
+	out.write(reinterpret_cast<const char*>(faceCounts.data()), faceCounts.size() * sizeof(std::uint32_t));
+}
+
+Model::Model(const std::string filename, const bool useCache, const bool optimize) : filename(filename) {
+	MappedFile in(filename);
+	if (!in.IsOpen()) {
+		std::cerr << "can't open file " << filename << std::endl;
+		return;
+	}
+
+	size_t dot = filename.find_last_of(".");
+	std::string cachefile = (dot == std::string::npos ? filename : filename.substr(0, dot)) + ".qsmesh";
+	std::vector<int> meshletFaces;
+	bool cached = useCache && LoadMeshCache(cachefile, in.GetSize(), in.GetModifiedTime(), optimize, meshletFaces);
+	if (!cached) {
+		ObjData obj;
+		ParseObj(in.GetData(), in.GetSize(), obj);
+		BuildVertexBuffer(obj);
+		if (optimize) OptimizeVertexCache();
+		meshletFaces = BuildMeshlets(optimize);
+		if (optimize) OptimizeVertexFetch();
+		if (useCache) SaveMeshCache(cachefile, in.GetSize(), in.GetModifiedTime(), optimize, meshletFaces);
+	}
+	ComputeMeshletBounds(meshletFaces);
+	std::cerr << "# v# " << GetNumberOfVertices() << " f# " << GetNumberOfFaces() << (cached ? " (cached)" : "") << std::endl;
 }
 
 vec3 Model::GetPosition() const {
 	return pos;
 }
 
+void Model::SetInstances(const std::vector<Transform>& transforms) {
+	instances = transforms;
+}
+
+int Model::GetNumberOfInstances() const {
+	return instances.empty() ? 1 : (int)instances.size();
+}
+
+Model::Transform Model::GetInstance(const int i) const {
+	if (!instances.empty()) return instances[i];
+	Transform transform;
+	transform.position = pos;
+	return transform;
+}
+
 std::string Model::GetFilename() const {
 	return filename;
 }
 
 int Model::GetNumberOfVertices() const {
-	return (int)verts.size();
+	return (int)vertices.size();
 }
 
 int Model::GetNumberOfFaces() const {
-	return (int)facet_vrt.size() / 3;
+	return (int)indices.size() / 3;
+}
+
+
+
+const Model::Vertex& Model::GetVertex(const int i) const {
+	return vertices[i];
+}
+
+int Model::GetIndex(const int iface, const int nthvert) const {
+	return (int)indices[iface * 3 + nthvert];
 }
 
 
 
 vec3 Model::GetVert(const int i) const {
-	return verts[i];
+	return vertices[i].pos;
 }
 
 vec3 Model::GetVert(const int iface, const int nthvert) const {
-	return verts[facet_vrt[iface * 3 + nthvert]];
+	return vertices[indices[iface * 3 + nthvert]].pos;
 }
 
 
 
 vec2 Model::GetTexcoord(const int i) const {
-	return tex_coord[i];
+	return vertices[i].uv;
 }
 
 vec2 Model::GetTexcoord(const int iface, const int nthvert) const {
-	return tex_coord[facet_tex[iface * 3 + nthvert]];
+	return vertices[indices[iface * 3 + nthvert]].uv;
 }
 
 
 
 vec3 Model::GetNormal(const int i) const {
-	return norms[i];
+	return vertices[i].normal;
 }
 
 vec3 Model::GetNormal(const int iface, const int nthvert) const {
-	return norms[facet_nrm[iface * 3 + nthvert]];
+	return vertices[indices[iface * 3 + nthvert]].normal;
+}
+
+
+
+vec3 Model::GetBoundsMin() const {
+	return boundsMin;
+}
+
+vec3 Model::GetBoundsMax() const {
+	return boundsMax;
+}
+
+int Model::GetNumberOfMeshlets() const {
+	return (int)meshlets.size();
 }
 
+const Model::Meshlet& Model::GetMeshlet(const int i) const {
+	return meshlets[i];
+}
 
+int Model::GetMeshletVertex(const int i) const {
+	return (int)meshletVertices[i];
+}
+
+bool LoadInstances(const std::string filename, std::vector<Model::Transform>& instances) {
+	std::ifstream in(filename);
+	if (!in.is_open()) {
+		std::cerr << "can't open file " << filename << std::endl;
+		return false;
+	}
+	std::string line;
+	while (std::getline(in, line)) {
+		std::istringstream fields(line);
+		Model::Transform transform;
+		vec3& p = transform.position;
+		if (!(fields >> p.x >> p.y >> p.z)) continue;
+		vec3& r = transform.rotation;
+		if (fields >> r.x >> r.y >> r.z) {
+			vec3& s = transform.scale;
+			if (fields >> s.x) {
+				if (!(fields >> s.y >> s.z)) s.y = s.z = s.x;
+			}
+		}
+		instances.push_back(transform);
+	}
+	return !instances.empty();
+}
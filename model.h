@@ -1,29 +1,87 @@
 #pragma once
 
+#include <cstdint>
 #include <vector>
 #include <string>
 #include "geometry.h"
 
+struct ObjData;
+
 class Model {
+public:
+    // One welded vertex: 32 bytes, so a vertex never straddles a cache line
+    struct alignas(32) Vertex {
+        vec3 pos;
+        vec2 uv;
+        vec3 normal;
+    };
+    // Run of consecutive faces touching at most MESHLET_MAX_VERTICES distinct vertices, with the
+    // bounds the renderer culls against before any of its vertices are transformed
+    struct Meshlet {
+        int firstFace, faceCount;
+        // The meshlet's distinct vertices, a range of the meshlet vertex list
+        int firstVertex, vertexCount;
+        vec3 center;
+        float radius;
+        // Every face normal lies within the cone around coneAxis whose half angle has the sine
+        // coneCutoff, 1 when the normals spread over a hemisphere or more
+        vec3 coneAxis;
+        float coneCutoff;
+    };
+    // Placement of one copy of the model: scaled, then rotated about x, y and z in turn (angles in
+    // degrees), then moved to position
+    struct Transform {
+        vec3 position{};
+        vec3 rotation{};
+        vec3 scale{ 1, 1, 1 };
+    };
+    static const int MESHLET_MAX_VERTICES = 64;
+    static const int MESHLET_MAX_FACES = 124;
+private:
     vec3 pos{};
+    std::vector<Transform> instances{};
     std::string filename;
-    std::vector<vec3> verts{};
-    std::vector<vec2> tex_coord{};
-    std::vector<vec3> norms{};
-    std::vector<int> facet_vrt{};
-    std::vector<int> facet_tex{};
-    std::vector<int> facet_nrm{};
+    std::vector<Vertex> vertices{};
+    std::vector<std::uint32_t> indices{};
+    std::vector<Meshlet> meshlets{};
+    std::vector<std::uint32_t> meshletVertices{};
+    vec3 boundsMin{}, boundsMax{};
+
+    void BuildVertexBuffer(const ObjData& obj);
+    void OptimizeVertexCache();
+    void OptimizeVertexFetch();
+    std::vector<int> BuildMeshlets(const bool optimize);
+    void ComputeMeshletBounds(const std::vector<int>& meshletFaces);
+    bool LoadMeshCache(const std::string cachefile, const std::uint64_t sourceSize, const std::uint64_t sourceTime, const bool optimize, std::vector<int>& meshletFaces);
+    void SaveMeshCache(const std::string cachefile, const std::uint64_t sourceSize, const std::uint64_t sourceTime, const bool optimize, const std::vector<int>& meshletFaces) const;
 public:
-    Model(const std::string filename);
+    // With useCache, a binary .qsmesh next to the obj file is read when up to date and written otherwise.
+    // With optimize, triangles are reordered for post-transform cache hits and vertices for fetch locality
+    Model(const std::string filename, const bool useCache = false, const bool optimize = true);
     std::string GetFilename() const;
     vec3 GetPosition() const;
+    // Instanced drawing: every copy shares the vertices, meshlets and textures. Without instances
+    // the model is drawn once at GetPosition()
+    void SetInstances(const std::vector<Transform>& transforms);
+    int GetNumberOfInstances() const;
+    Transform GetInstance(const int i) const;
     int GetNumberOfVertices() const;
     int GetNumberOfFaces() const;
+    const Vertex& GetVertex(const int i) const;
+    int GetIndex(const int iface, const int nthvert) const;
     vec3 GetVert(const int i) const;
     vec3 GetVert(const int iface, const int nthvert) const;
     vec3 GetNormal(const int i) const;
     vec3 GetNormal(const int iface, const int nthvert) const;
     vec2 GetTexcoord(const int i) const;
     vec2 GetTexcoord(const int iface, const int nthvert) const;
+    // Object space bounding box of all vertices
+    vec3 GetBoundsMin() const;
+    vec3 GetBoundsMax() const;
+    int GetNumberOfMeshlets() const;
+    const Meshlet& GetMeshlet(const int i) const;
+    int GetMeshletVertex(const int i) const;
 };
 
+// One instance per line as "posX posY posZ [rotX rotY rotZ [scale | scaleX scaleY scaleZ]]"
+bool LoadInstances(const std::string filename, std::vector<Model::Transform>& instances);
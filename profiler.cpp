@@ -0,0 +1,203 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include "profiler.h"
+
+static const char* COUNTER_NAMES[(int)ProfileCounter::COUNT] = {
+	"triangles in", "triangles culled", "pixels tested", "depth passed", "fragments shaded"
+};
+
+struct ProfileEvent {
+	const char* name;
+	long long start, end;
+	int depth;
+};
+
+// Events and counters of one thread. Only the thread itself records; EndFrame takes the events
+// under the mutex and resets the counters between frames
+struct ThreadProfile {
+	int tid = 0;
+	std::string name;
+	int depth = 0;
+	std::mutex eventsMutex;
+	std::vector<ProfileEvent> events;
+	std::atomic<long long> counters[(int)ProfileCounter::COUNT] = {};
+};
+
+struct TraceEvent {
+	ProfileEvent event;
+	int tid;
+};
+
+std::atomic<bool> Profiler::enabled(false);
+
+static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+// Every thread that ever recorded, kept until exit so the trace can name them
+static std::mutex registryMutex;
+static std::vector<std::unique_ptr<ThreadProfile>> threadProfiles;
+static bool tracing = false;
+static std::vector<TraceEvent> traceEvents;
+static std::vector<std::pair<long long, FrameProfile>> traceFrames;
+static int frameCount = 0;
+
+static thread_local ThreadProfile* localProfile = nullptr;
+
+static ThreadProfile& GetThreadProfile() {
+	if (!localProfile) {
+		std::lock_guard<std::mutex> lock(registryMutex);
+		threadProfiles.emplace_back(new ThreadProfile());
+		localProfile = threadProfiles.back().get();
+		localProfile->tid = (int)threadProfiles.size();
+		localProfile->name = "thread " + std::to_string(localProfile->tid);
+	}
+	return *localProfile;
+}
+
+std::string FrameProfile::Summary() const {
+	char buf[128];
+	std::snprintf(buf, sizeof(buf), "# frame %d %.2f ms |", frame, milliseconds);
+	std::string line = buf;
+	for (const auto& stage : stages) {
+		std::snprintf(buf, sizeof(buf), " %s %.2f", stage.first, stage.second);
+		line += buf;
+	}
+	line += " |";
+	for (int c = 0; c < (int)ProfileCounter::COUNT; c++) {
+		std::snprintf(buf, sizeof(buf), "%s %s %lld", c ? "," : "", COUNTER_NAMES[c], counters[c]);
+		line += buf;
+	}
+	std::snprintf(buf, sizeof(buf), ", overdraw %.2f", overdraw);
+	return line + buf;
+}
+
+void Profiler::SetEnabled(const bool enable) {
+	enabled.store(enable, std::memory_order_relaxed);
+}
+
+void Profiler::SetTracing(const bool enable) {
+	std::lock_guard<std::mutex> lock(registryMutex);
+	tracing = enable;
+}
+
+void Profiler::SetThreadName(const std::string& name) {
+	ThreadProfile& profile = GetThreadProfile();
+	std::lock_guard<std::mutex> lock(registryMutex);
+	profile.name = name;
+}
+
+long long Profiler::Now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+void Profiler::BeginScope() {
+	GetThreadProfile().depth++;
+}
+
+void Profiler::EndScope(const char* name, const long long start, const long long end) {
+	ThreadProfile& profile = GetThreadProfile();
+	profile.depth--;
+	std::lock_guard<std::mutex> lock(profile.eventsMutex);
+	profile.events.push_back({ name, start, end, profile.depth });
+}
+
+void Profiler::Count(const ProfileCounter counter, const long long n) {
+	// Single writer, a plain load and store is enough
+	std::atomic<long long>& value = GetThreadProfile().counters[(int)counter];
+	value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+FrameProfile Profiler::EndFrame(const long long pixels) {
+	ThreadProfile& self = GetThreadProfile();
+	std::lock_guard<std::mutex> lock(registryMutex);
+	FrameProfile profile;
+	profile.frame = frameCount++;
+
+	for (const std::unique_ptr<ThreadProfile>& thread : threadProfiles) {
+		for (int c = 0; c < (int)ProfileCounter::COUNT; c++) {
+			profile.counters[c] += thread->counters[c].exchange(0, std::memory_order_relaxed);
+		}
+
+		std::lock_guard<std::mutex> eventsLock(thread->eventsMutex);
+		for (const ProfileEvent& event : thread->events) {
+			if (tracing) traceEvents.push_back({ event, thread->tid });
+			if (thread.get() != &self) continue;
+
+			// The outermost scopes make up the frame, the ones directly inside them are its stages
+			double ms = (event.end - event.start) / 1e6;
+			if (event.depth == 0) profile.milliseconds += ms;
+			if (event.depth != 1) continue;
+			auto it = profile.stages.begin();
+			while (it != profile.stages.end() && std::strcmp(it->first, event.name)) ++it;
+			if (it == profile.stages.end()) profile.stages.emplace_back(event.name, ms);
+			else it->second += ms;
+		}
+		// Keep the capacity, the next frame records about as many events
+		thread->events.clear();
+	}
+
+	long long fragments = profile.counters[(int)ProfileCounter::FRAGMENTS_SHADED];
+	profile.overdraw = pixels > 0 ? (double)fragments / pixels : 0;
+	if (tracing) traceFrames.emplace_back(Now(), profile);
+	return profile;
+}
+
+// Complete event with microsecond timestamps
+static void WriteTraceEvent(std::ostream& out, const ProfileEvent& event, const int tid) {
+	char buf[256];
+	std::snprintf(buf, sizeof(buf), "{\"name\": \"%s\", \"cat\": \"qs\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+		event.name, tid, event.start / 1e3, (event.end - event.start) / 1e3);
+	out << buf;
+}
+
+bool Profiler::WriteTrace(const std::string& filename) {
+	std::ofstream out(filename);
+	if (!out.is_open()) {
+		std::cerr << "can't open file " << filename << std::endl;
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(registryMutex);
+	bool first = true;
+	auto separator = [&]() { out << (first ? "\n" : ",\n"); first = false; };
+
+	out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+	for (const std::unique_ptr<ThreadProfile>& thread : threadProfiles) {
+		separator();
+		out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << thread->tid << ", \"args\": {\"name\": \"" << thread->name << "\"}}";
+	}
+	for (const TraceEvent& trace : traceEvents) {
+		separator();
+		WriteTraceEvent(out, trace.event, trace.tid);
+	}
+	// Events of the frame in progress, e.g. the output thread still writing the last image
+	for (const std::unique_ptr<ThreadProfile>& thread : threadProfiles) {
+		std::lock_guard<std::mutex> eventsLock(thread->eventsMutex);
+		for (const ProfileEvent& event : thread->events) {
+			separator();
+			WriteTraceEvent(out, event, thread->tid);
+		}
+	}
+	// One counter sample per frame, at its end
+	for (const auto& frame : traceFrames) {
+		separator();
+		char buf[128];
+		std::snprintf(buf, sizeof(buf), "{\"name\": \"frame counters\", \"ph\": \"C\", \"pid\": 1, \"ts\": %.3f, \"args\": {", frame.first / 1e3);
+		out << buf;
+		for (int c = 0; c < (int)ProfileCounter::COUNT; c++) {
+			out << (c ? ", \"" : "\"") << COUNTER_NAMES[c] << "\": " << frame.second.counters[c];
+		}
+		out << "}}";
+	}
+	out << "\n]}\n";
+
+	if (!out.good()) {
+		std::cerr << "can't write file " << filename << std::endl;
+		return false;
+	}
+	return true;
+}
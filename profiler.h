@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Stage timing and pipeline counters. Defining QS_NO_PROFILE compiles every QS_PROFILE_SCOPE and
+// QS_PROFILE_COUNT away; otherwise they cost a flag test while the profiler is off, and two clock
+// reads and an append to the thread's own event list while it is on
+#if !defined(QS_NO_PROFILE)
+#define QS_PROFILE 1
+#endif
+
+enum class ProfileCounter { TRIANGLES_IN, TRIANGLES_CULLED, PIXELS_TESTED, DEPTH_PASSED, FRAGMENTS_SHADED, COUNT };
+
+// Stages and counters of one frame
+struct FrameProfile {
+	int frame = 0;
+	double milliseconds = 0;
+	// Time per top-level scope of the thread that ends the frame, by name in first-use order
+	std::vector<std::pair<const char*, double>> stages;
+	long long counters[(int)ProfileCounter::COUNT] = {};
+	// Fragments shaded per pixel of the frame
+	double overdraw = 0;
+
+	// One line: frame time, stage times and counters
+	std::string Summary() const;
+};
+
+class Profiler {
+	static std::atomic<bool> enabled;
+
+public :
+	static bool IsEnabled() { return enabled.load(std::memory_order_relaxed); }
+	// Scopes and counters are ignored while disabled
+	static void SetEnabled(const bool enable);
+	// Keep every frame's events for WriteTrace, otherwise they are dropped when their frame ends
+	static void SetTracing(const bool enable);
+	// Name of the calling thread in the trace
+	static void SetThreadName(const std::string& name);
+
+	// Nanoseconds on a steady clock
+	static long long Now();
+	static void BeginScope();
+	static void EndScope(const char* name, const long long start, const long long end);
+	static void Count(const ProfileCounter counter, const long long n);
+
+	// Close the frame the events and counters recorded since the last call belong to. Called
+	// between frames, while no worker thread is counting; pixels is the frame's size for overdraw
+	static FrameProfile EndFrame(const long long pixels);
+	// Chrome trace JSON (chrome://tracing, Perfetto) of every traced frame, false when it can't be written
+	static bool WriteTrace(const std::string& filename);
+};
+
+// Times the enclosing block under name, which has to be a string literal
+class ProfileScope {
+	const char* name;
+	long long start;
+
+public :
+	explicit ProfileScope(const char* name) : name(name), start(-1) {
+		if (!Profiler::IsEnabled()) return;
+		Profiler::BeginScope();
+		start = Profiler::Now();
+	}
+	~ProfileScope() {
+		if (start >= 0) Profiler::EndScope(name, start, Profiler::Now());
+	}
+	ProfileScope(const ProfileScope&) = delete;
+	ProfileScope& operator=(const ProfileScope&) = delete;
+};
+
+#if QS_PROFILE
+#define QS_PROFILE_CONCAT_(a, b) a##b
+#define QS_PROFILE_CONCAT(a, b) QS_PROFILE_CONCAT_(a, b)
+#define QS_PROFILE_SCOPE(name) ProfileScope QS_PROFILE_CONCAT(profileScope, __LINE__)(name)
+#define QS_PROFILE_COUNT(counter, n) do { if (Profiler::IsEnabled()) Profiler::Count(ProfileCounter::counter, n); } while (0)
+#else
+#define QS_PROFILE_SCOPE(name) ((void)0)
+#define QS_PROFILE_COUNT(counter, n) ((void)0)
+#endif
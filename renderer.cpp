@@ -1,94 +1,1113 @@
+#include <algorithm>
+#include <cstring>
+#include <new>
 #include "renderer.h"
 
 #include "shader.h"
 
+// Post-viewport triangle and its edge-function setup, allocated in the frame arena
+struct Triangle {
+	vec2 screenPos[3];
+	double invW[3];
+	int xmin, ymin, xmax, ymax;
+
+	// E_i = edgeA[i] * X + edgeB[i] * Y + edgeC[i] over subpixel coordinates, with the
+	// top-left fill rule folded into edgeC so that a sample is covered iff all E_i >= 0
+	long long edgeA[3], edgeB[3], edgeC[3];
+	// 1/w_i over twice the area, so that sum(E_i * invWArea[i]) is the interpolated 1/w
+	double invWArea[3];
+	// Per-pixel steps of E_i * invWArea[i], for the screen-space derivatives of the barycentrics
+	float invWDx[3], invWDy[3];
+
+	// Nearest depth over the triangle, for the hierarchical Z test
+	float minDepth;
+
+	// Position in the frame's triangle list and the draw it came from
+	int id;
+	int drawIndex;
+
+	Shader::Varyings varyings;
+};
+
+// Vertex of a clipped polygon, bar holds its weights over the original triangle's vertices
+struct ClipVertex {
+	vec4 pos;
+	vec3 bar;
+};
+
+// One Draw<ShaderT> of the frame, with the shader-specific entry points of its later passes
+struct DrawCall {
+	std::unique_ptr<Shader, ArenaDelete> shader;
+	int firstTriangle, endTriangle;
+	void (Renderer::*rasterize)(const DrawCall&);
+	int (Renderer::*shadeFragments)(const Triangle&, const Shader&, const int mask, const float* bar[3], const float* depth, vec3* color) const;
+};
+
+// Stand-in shader type for the passes that only write depth or triangle ids
+struct NoFragmentShader {
+	bool fragment(const Shader::Varyings&, vec3, vec3, vec3, vec3&) const { return true; }
+};
+
+// Shaders selectable per model, the first one is the default
+struct ShaderEntry {
+	const char* name;
+	void (Renderer::*draw)(Model&);
+	std::vector<std::string> textures;
+};
+
+static const ShaderEntry SHADER_REGISTRY[] = {
+	{ "blinnphong", &Renderer::Draw<BlinnPhongShader>, { "_main.tga", "_spec.tga" } },
+	{ "bump", &Renderer::Draw<BumpShader>, { "_main.tga", "_spec.tga", "_nm_tangent.tga" } },
+};
+static const int SHADER_REGISTRY_SIZE = sizeof(SHADER_REGISTRY) / sizeof(SHADER_REGISTRY[0]);
+
+// Standard multisample positions in 1/16 pixel from the pixel center, no two samples share a row or column
+static const int SAMPLE_PATTERN_1[1][2] = { { 0, 0 } };
+static const int SAMPLE_PATTERN_2[2][2] = { { 4, 4 }, { -4, -4 } };
+static const int SAMPLE_PATTERN_4[4][2] = { { -2, -6 }, { 6, -2 }, { -6, 2 }, { 2, 6 } };
+static const int SAMPLE_PATTERN_8[8][2] = { { 1, -3 }, { -1, 3 }, { 5, 1 }, { -3, -5 }, { -5, 5 }, { -7, -1 }, { 3, 7 }, { 7, -7 } };
+
+// RGBA8 with red in the lowest byte. Same rounding as the 8-bit image had from the float frame
+// buffer, NaN goes to 0
+static std::uint32_t PackColor(const vec3& color) {
+#if defined(QS_SSE2)
+	const __m128 scale = _mm_set1_ps(255.f);
+	__m128 v = _mm_mul_ps(_mm_setr_ps(color.x, color.y, color.z, 0), scale);
+	__m128i c = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), scale));
+	c = _mm_packs_epi32(c, c);
+	return (std::uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(c, c));
+#else
+	auto channel = [](const float v) { return (std::uint32_t)std::min(255.f, std::max(0.f, v * 255.f)); };
+	return channel(color.x) | channel(color.y) << 8 | channel(color.z) << 16;
+#endif
+}
+
+#if QS_PROFILE
+static int BitCount(int mask) {
+	int count = 0;
+	for (; mask; mask &= mask - 1) count++;
+	return count;
+}
+#endif
+
+// Perspective-correct barycentrics at the edge function values E, returns the depth
+static float PerspectiveBarycentrics(const Triangle& tri, const long long E[3], float bar[3]) {
+	double e[3];
+	for (int k = 0; k < 3; k++) e[k] = E[k] * tri.invWArea[k];
+	double invDepth = e[0] + e[1] + e[2];
+	for (int k = 0; k < 3; k++) bar[k] = (float)(e[k] / invDepth);
+	return (float)(1 / invDepth);
+}
+
 Renderer::Renderer(Camera& camera, Light& light, std::vector<Model*>& modelArray, int width, int height) :
 	camera(camera), 
 	light(light), 
 	modelArray(modelArray), 
 	width(width), 
 	height(height), 
-	zBuffer(width, height, 1e10), 
-	frameBuffer(width, height)
-{}
+	zBuffer(width, height, 1e10f, TILE_SIZE, TILE_SIZE, BufferLayout::TILED), 
+	frameBuffer(width, height, 0, TILE_SIZE, TILE_SIZE),
+	visibilityBuffer(width, height, -1, TILE_SIZE, TILE_SIZE),
+	blockMaxZ((width + BLOCK_SIZE - 1) / BLOCK_SIZE, (height + BLOCK_SIZE - 1) / BLOCK_SIZE, 1e10f, TILE_SIZE / BLOCK_SIZE, TILE_SIZE / BLOCK_SIZE),
+	tileMaxZ((width + TILE_SIZE - 1) / TILE_SIZE, (height + TILE_SIZE - 1) / TILE_SIZE, 1e10f),
+	tilesX((width + TILE_SIZE - 1) / TILE_SIZE),
+	tilesY((height + TILE_SIZE - 1) / TILE_SIZE),
+	simdLevel(DetectSimdLevel()),
+	guardBandX((float)GUARD_BAND / width),
+	guardBandY((float)GUARD_BAND / height)
+{
+}
+
+Renderer::~Renderer() = default;
 
 void Renderer::RenderMainFun() {
+	QS_PROFILE_SCOPE("frame");
+	RenderFrame();
+	if (!output) SetOutputSink(std::make_unique<FileSink>("output", "tga"));
+	RGBImage image = output->AcquireImage(width, height);
+	{
+		QS_PROFILE_SCOPE("resolve");
+		ResolveImage(image);
+	}
+	QS_PROFILE_SCOPE("submit");
+	output->Submit(std::move(image));
+}
 
+void Renderer::RenderFrame() {
+	{
+		QS_PROFILE_SCOPE("textures");
+		PreloadTextures();
+	}
+	BeginFrame();
+	// One dispatch per model picks the shader type, everything below Draw is specialized on it
 	for (Model* model : modelArray) {
-		BlinnPhongShader shader(*this, *model);
+		auto it = modelShaders.find(model);
+		(this->*SHADER_REGISTRY[it == modelShaders.end() ? 0 : it->second].draw)(*model);
+	}
+	EndFrame();
+	QS_PROFILE_COUNT(TRIANGLES_IN, stats.facesDrawn);
+	QS_PROFILE_COUNT(TRIANGLES_CULLED, stats.facesCulled);
+}
+
+RGBImage Renderer::ResolveImage() const {
+	RGBImage image(width, height);
+	ResolveImage(image);
+	return image;
+}
+
+void Renderer::ResolveImage(RGBImage& image) const {
+#pragma omp parallel for
+	for (int y = 0; y < height; y++) {
+		const std::uint32_t* src = frameBuffer.GetRow(y);
+		std::uint8_t* dst = image.GetRow(y);
+		for (int x = 0; x < width; x++) {
+			dst[x * 3] = (std::uint8_t)src[x];
+			dst[x * 3 + 1] = (std::uint8_t)(src[x] >> 8);
+			dst[x * 3 + 2] = (std::uint8_t)(src[x] >> 16);
+		}
+	}
+}
+
+void Renderer::SetOutputSink(std::unique_ptr<FrameSink> sink, const int maxQueued) {
+	output.reset();
+	output = std::make_unique<ImageWriter>(std::move(sink), maxQueued);
+}
+
+int Renderer::FlushOutput() {
+	if (!output) return 0;
+	output->Flush();
+	return output->GetFailures();
+}
+
+void Renderer::BeginFrame() {
+	// The previous frame's shaders go before the memory they live in
+	stats = RenderStats();
+	triangles.clear();
+	drawCalls.clear();
+	frameArena.Reset();
+	{
+		// Lazy clears, the raster clears a tile the first time a triangle reaches it and the
+		// passes reading whole buffers clear the tiles nothing reached. Deferred shading writes
+		// every pixel, and so does the resolve of the samples
+		QS_PROFILE_SCOPE("clear");
+		zBuffer.Clear();
+		blockMaxZ.Clear();
+		tileMaxZ.Fill(1e10f);
+		if (shadingMode == ShadingMode::DEFERRED) visibilityBuffer.Clear();
+		else if (sampleCount > 1) sampleColors.Clear();
+		else frameBuffer.Clear();
+	}
+
+	if (shadowMap) {
+		QS_PROFILE_SCOPE("shadow map");
+		RenderShadowMap();
+	}
+
+	keepTriangles = shadingMode == ShadingMode::DEFERRED || depthPrepass;
+	rasterPass = RasterPass::SHADE;
+}
+
+template<typename ShaderT> void Renderer::Draw(Model& model) {
+	DrawCall call;
+	call.rasterize = &Renderer::RasterizeDraw<ShaderT>;
+	call.shadeFragments = &Renderer::ShadeDrawFragments<ShaderT>;
+
+	if (!keepTriangles) {
+		triangles.clear();
+		drawCalls.clear();
+	}
+	call.firstTriangle = (int)triangles.size();
+
+	// The fragment stage only sees world space varyings, so one shader serves every instance and
+	// only the vertex stage is rerun with each instance's matrix
+	for (int instance = 0; instance < model.GetNumberOfInstances(); instance++) {
+		mat<4, 4> modelMatrix = GetModelMatrix(model, instance);
+		{
+			QS_PROFILE_SCOPE("cull");
+			if (!CullMeshlets(model, modelMatrix)) continue;
+		}
+		if (!call.shader) call.shader.reset(frameArena.Get().New<ShaderT>(*this, model));
+		call.shader->SetModelMatrix(modelMatrix);
+		{
+			QS_PROFILE_SCOPE("vertex");
+			call.shader->ProcessVertices(visibleMeshlets);
+		}
+		{
+			QS_PROFILE_SCOPE("geometry");
+			ProcessGeometry(*call.shader, (int)drawCalls.size());
+		}
+	}
+	if (!call.shader) return;
+	call.endTriangle = (int)triangles.size();
+	drawCalls.push_back(std::move(call));
+
+	// Forward shading without a prepass draws each model as soon as its geometry is done
+	if (!keepTriangles) RasterizeDraw<ShaderT>(drawCalls.back());
+}
+
+void Renderer::EndFrame() {
+	if (shadingMode == ShadingMode::DEFERRED) {
+		rasterPass = RasterPass::VISIBILITY;
+		RasterizeTiles(0, (int)triangles.size(), NoFragmentShader());
+		QS_PROFILE_SCOPE("shade");
+		visibilityBuffer.ClearStaleTiles();
+		if (sampleCount > 1) ShadeVisibilitySamples();
+		else ShadeVisibilityBuffer();
+	}
+	else if (depthPrepass) {
+		rasterPass = RasterPass::DEPTH;
+		RasterizeTiles(0, (int)triangles.size(), NoFragmentShader());
+		rasterPass = RasterPass::SHADE;
+		for (const DrawCall& call : drawCalls) (this->*call.rasterize)(call);
+	}
+	rasterPass = RasterPass::SHADE;
+	if (sampleCount > 1) {
+		QS_PROFILE_SCOPE("resolve samples");
+		sampleColors.ClearStaleTiles();
+		ResolveSamples();
+	}
+	frameBuffer.ClearStaleTiles();
+}
+
+template<typename ShaderT> void Renderer::RasterizeDraw(const DrawCall& call) {
+	RasterizeTiles(call.firstTriangle, call.endTriangle, static_cast<const ShaderT&>(*call.shader));
+}
+
+template<typename ShaderT> int Renderer::ShadeDrawFragments(const Triangle& tri, const Shader& shader, const int mask, const float* bar[3], const float* depth, vec3* color) const {
+	return ShadeFragments(tri, static_cast<const ShaderT&>(shader), mask, bar, depth, color);
+}
+
+// Depth-only pass from the light over the world-space bounds of every model instance
+void Renderer::RenderShadowMap() {
+	vec3 lo(1e30f, 1e30f, 1e30f), hi(-1e30f, -1e30f, -1e30f);
+	for (const Model* model : modelArray) {
+		if (!model->GetNumberOfVertices()) continue;
+		vec3 boundsMin = model->GetBoundsMin(), boundsMax = model->GetBoundsMax();
+		for (int instance = 0; instance < model->GetNumberOfInstances(); instance++) {
+			mat<4, 4> modelMatrix = GetModelMatrix(*model, instance);
+			for (int corner = 0; corner < 8; corner++) {
+				vec3 c((corner & 1) ? boundsMax.x : boundsMin.x, (corner & 2) ? boundsMax.y : boundsMin.y, (corner & 4) ? boundsMax.z : boundsMin.z);
+				vec3 p = proj<3>(modelMatrix * embed<4>(c));
+				for (int k = 0; k < 3; k++) {
+					lo[k] = std::min(lo[k], p[k]);
+					hi[k] = std::max(hi[k], p[k]);
+				}
+			}
+		}
+	}
+	if (lo.x > hi.x) return;
+
+	vec3 center = (lo + hi) * 0.5f;
+	shadowMap->Begin(GetWorldSpaceLightDir(), center, std::max((hi - center).norm(), 1e-3f));
+	for (const Model* model : modelArray) {
+		for (int instance = 0; instance < model->GetNumberOfInstances(); instance++) shadowMap->Draw(*model, GetModelMatrix(*model, instance));
+	}
+}
+
+// Test the model's bounding box, then each meshlet's sphere, against the view frustum, and each
+// meshlet's normal cone against the camera position, all in world space. Fills visibleMeshlets
+// and returns false when nothing is left to draw
+bool Renderer::CullMeshlets(const Model& model, const mat<4, 4>& modelMatrix) {
+	mat<4, 4> normalMatrix = modelMatrix.invert_transpose();
+	mat<4, 4> viewProj = GetCameraProjectMatrix() * GetCameraViewMatrix();
+
+	// Frustum planes (normal, offset) with the inside at n * p + d >= 0
+	vec4 planes[6];
+	for (int i = 0; i < 3; i++) {
+		planes[i * 2] = viewProj[3] + viewProj[i];
+		planes[i * 2 + 1] = viewProj[3] - viewProj[i];
+	}
+	for (vec4& plane : planes) plane = plane * (1 / proj<3>(plane).norm());
+
+	// Scale of the model matrix's longest axis grows the bounding spheres. A non-uniform scale
+	// bends the normals by different amounts, the cones no longer bound them
+	float scale = 0, minScale = 1e30f;
+	for (int j = 0; j < 3; j++) {
+		float axisScale = vec3(modelMatrix[0][j], modelMatrix[1][j], modelMatrix[2][j]).norm();
+		scale = std::max(scale, axisScale);
+		minScale = std::min(minScale, axisScale);
+	}
+	bool coneCulling = cullMode != CullMode::NONE && scale <= minScale * 1.001f;
+
+	vec3 lo = model.GetBoundsMin(), hi = model.GetBoundsMax();
+	vec3 center = proj<3>(modelMatrix * embed<4>((lo + hi) * 0.5f));
+	vec3 halfSize = (hi - lo) * 0.5f, extent;
+	for (int i = 0; i < 3; i++) {
+		extent[i] = std::abs(modelMatrix[i][0]) * halfSize.x + std::abs(modelMatrix[i][1]) * halfSize.y + std::abs(modelMatrix[i][2]) * halfSize.z;
+	}
+	visibleMeshlets.clear();
+	stats.facesDrawn += model.GetNumberOfFaces();
+	for (const vec4& plane : planes) {
+		vec3 n = proj<3>(plane);
+		float r = std::abs(n.x) * extent.x + std::abs(n.y) * extent.y + std::abs(n.z) * extent.z;
+		if (n * center + plane[3] < -r) {
+			stats.modelsCulled++;
+			stats.facesCulled += model.GetNumberOfFaces();
+			return false;
+		}
+	}
+
+	vec3 eye = GetCameraPos();
+	for (int m = 0; m < model.GetNumberOfMeshlets(); m++) {
+		const Model::Meshlet& meshlet = model.GetMeshlet(m);
+		vec3 c = proj<3>(modelMatrix * embed<4>(meshlet.center));
+		float r = meshlet.radius * scale;
+
+		bool outside = false;
+		for (const vec4& plane : planes) outside = outside || proj<3>(plane) * c + plane[3] < -r;
+		if (outside) {
+			stats.meshletsFrustumCulled++;
+			stats.facesCulled += meshlet.faceCount;
+			continue;
+		}
+
+		// Every face is back facing when the direction to the sphere stays within the cone's
+		// complement around the axis, i.e. no normal can point towards the eye
+		if (coneCulling && meshlet.coneCutoff < 1) {
+			vec3 axis = proj<3>(normalMatrix * embed<4>(meshlet.coneAxis, 0.f)).normalize();
+			if (cullMode == CullMode::FRONT) axis = axis * -1.f;
+			vec3 view = c - eye;
+			if (view * axis >= meshlet.coneCutoff * view.norm() + r) {
+				stats.meshletsConeCulled++;
+				stats.facesCulled += meshlet.faceCount;
+				continue;
+			}
+		}
+		visibleMeshlets.push_back(m);
+	}
+	return !visibleMeshlets.empty();
+}
+
+// Geometry stage: clip the visible meshlets' faces and set up the surviving triangles, in parallel
+// over the meshlets. Each meshlet's triangles go to the arena of the thread that set them up and
+// are appended to the frame in meshlet order, so the triangle ids don't depend on the threads
+void Renderer::ProcessGeometry(const Shader& shader, const int drawIndex) {
+	mat<4, 4> viewportMatrix = GetViewportMatrix();
+	const Model& model = shader.GetModel();
+	const int count = (int)visibleMeshlets.size();
+	Arena& arena = frameArena.Get();
+	Triangle** meshletTriangles = arena.Allocate<Triangle*>(count);
+	int* meshletTriangleCounts = arena.Allocate<int>(count);
+	RenderStats* meshletStats = arena.Allocate<RenderStats>(count);
+
+#pragma omp parallel
+	{
+		// The team may be larger than the thread count the arenas were sized for at BeginFrame
+#pragma omp single
+		frameArena.ReserveTeam();
+#pragma omp for schedule(dynamic)
+		for (int m = 0; m < count; m++) {
+			const Model::Meshlet& meshlet = model.GetMeshlet(visibleMeshlets[m]);
+			RenderStats& local = *new (&meshletStats[m]) RenderStats();
+			// Room for every face clipped into a full fan, trimmed to the triangles set up
+			Arena& threadArena = frameArena.GetThreadArena();
+			Triangle* out = threadArena.Allocate<Triangle>(meshlet.faceCount * (MAX_CLIP_VERTICES - 2));
+			int n = 0;
+			for (int i = meshlet.firstFace; i < meshlet.firstFace + meshlet.faceCount; i++) {
+				vec4 clipPos[3];
+				Shader::Varyings varyings;
+				shader.AssembleFace(i, clipPos, varyings);
+
+				ClipVertex poly[MAX_CLIP_VERTICES];
+				bool clipped;
+				int nverts = ClipTriangle(clipPos, poly, clipped);
+				local.facesSubmitted++;
+				if (nverts < 3) local.frustumCulled++;
+				const int faceStart = n;
+
+				// Fan-triangulate the clipped polygon
+				for (int k = 1; k + 1 < nverts; k++) {
+					Triangle& tri = *new (&out[n]) Triangle();
+					const ClipVertex* v[3] = { &poly[0], &poly[k], &poly[k + 1] };
+					if (clipped) {
+						mat<3, 3> bar;
+						for (int j = 0; j < 3; j++) bar.set_col(j, v[j]->bar);
+						tri.varyings = varyings.Sub(bar);
+					}
+					else {
+						tri.varyings = varyings;
+					}
+
+					// Homogeneous division and viewport transform
+					for (int j = 0; j < 3; j++) {
+						tri.invW[j] = 1 / v[j]->pos[3];
+						tri.screenPos[j] = proj<2>(viewportMatrix * embed<4>(proj<2>(v[j]->pos * tri.invW[j])));
+					}
+
+					tri.drawIndex = drawIndex;
+					if (SetupTriangle(tri, local)) n++;
+				}
+				if (n == faceStart) local.facesCulled++;
+			}
+			threadArena.Trim(out, n);
+			meshletTriangles[m] = out;
+			meshletTriangleCounts[m] = n;
+		}
+	}
+
+	for (int m = 0; m < count; m++) {
+		for (int i = 0; i < meshletTriangleCounts[m]; i++) {
+			Triangle* tri = meshletTriangles[m] + i;
+			tri->id = (int)triangles.size();
+			triangles.push_back(tri);
+		}
+		stats += meshletStats[m];
+	}
+}
+
+// Bin the triangles in [firstTriangle, endTriangle) and rasterize them tile by tile. Each worker
+// owns whole tiles, so the depth test, the hierarchical Z and the buffer writes never race
+template<typename ShaderT> void Renderer::RasterizeTiles(const int firstTriangle, const int endTriangle, const ShaderT& shader) {
+	QS_PROFILE_SCOPE("raster");
+	// Count the triangles per tile, then lay every tile's triangle indices out contiguously in
+	// the frame arena, in submission order
+	const int tiles = tilesX * tilesY;
+	Arena& arena = frameArena.Get();
+	int* binStart = arena.Allocate<int>(tiles + 1);
+	int* binFill = arena.Allocate<int>(tiles);
+	std::fill(binFill, binFill + tiles, 0);
+	for (int i = firstTriangle; i < endTriangle; i++) {
+		ForEachTile(*triangles[i], [&](const int t) { binFill[t]++; });
+	}
+	binStart[0] = 0;
+	for (int t = 0; t < tiles; t++) {
+		binStart[t + 1] = binStart[t] + binFill[t];
+		binFill[t] = binStart[t];
+	}
+	int* binTriangles = arena.Allocate<int>(binStart[tiles]);
+	for (int i = firstTriangle; i < endTriangle; i++) {
+		ForEachTile(*triangles[i], [&](const int t) { binTriangles[binFill[t]++] = i; });
+	}
 
-		int n = model->GetNumberOfFaces();
-		for (int i = 0; i < n; i++) {
-			vec4 clipPos[3];
-			for (int j = 0; j < 3; j++) {
-				shader.PreWork(i, j);
-				clipPos[j] = shader.vertex(j);
+	long long hiZCulled = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+:hiZCulled)
+	for (int t = 0; t < tiles; t++) {
+		if (binStart[t] == binStart[t + 1]) continue;
+		QS_PROFILE_SCOPE("tile");
+		int tileX = t % tilesX, tileY = t / tilesX;
+		zBuffer.ClearTile(tileX, tileY);
+		blockMaxZ.ClearTile(tileX, tileY);
+		if (rasterPass == RasterPass::VISIBILITY) visibilityBuffer.ClearTile(tileX, tileY);
+		else if (sampleCount > 1) sampleColors.ClearTile(tileX, tileY);
+		else frameBuffer.ClearTile(tileX, tileY);
+		for (int b = binStart[t]; b < binStart[t + 1]; b++) {
+			const Triangle& tri = *triangles[binTriangles[b]];
+			if (tri.minDepth > tileMaxZ.GetValue(tileX, tileY)) {
+				hiZCulled++;
+				continue;
 			}
+			if (!RasterizeTriangle(tri, shader, tileX, tileY)) continue;
 
-			// Homogeneous division
-			for (int j = 0; j < 3; j++) {
-				double tmpw = clipPos[j][3];
-				clipPos[j] = clipPos[j] / tmpw;
-				clipPos[j][3] = tmpw;
+			float tileMax = 0;
+			for (int by = tileY * TILE_SIZE / BLOCK_SIZE; by < std::min((tileY + 1) * TILE_SIZE / BLOCK_SIZE, blockMaxZ.GetHeight()); by++) {
+				for (int bx = tileX * TILE_SIZE / BLOCK_SIZE; bx < std::min((tileX + 1) * TILE_SIZE / BLOCK_SIZE, blockMaxZ.GetWidth()); bx++) {
+					tileMax = std::max(tileMax, blockMaxZ.GetValue(bx, by));
+				}
 			}
+			tileMaxZ.SetValue(tileX, tileY, tileMax);
+		}
+	}
+	stats.hiZCulled += hiZCulled;
+}
 
-			// Viewport Transform
-			mat<4, 4> viewportMatrix = GetViewportMatrix();
-			vec2 screenPos[3];
+int Renderer::ClipTriangle(const vec4 clipPos[3], ClipVertex* poly, bool& clipped) const {
+	// Signed distance to the near, far and guard-band planes, inside when >= 0.
+	// A guard of 1 gives the view frustum itself.
+	auto dist = [](const vec4& p, const int plane, const float guardX, const float guardY) -> float {
+		switch (plane) {
+		case 0: return p[3] + p[2];
+		case 1: return p[3] - p[2];
+		case 2: return guardX * p[3] + p[0];
+		case 3: return guardX * p[3] - p[0];
+		case 4: return guardY * p[3] + p[1];
+		default: return guardY * p[3] - p[1];
+		}
+	};
 
-			for (int j = 0; j < 3; j++) {
-				screenPos[j] = proj<2>(viewportMatrix * embed<4>(proj<2>(clipPos[j])));
+	int clipMask = 0;
+	for (int plane = 0; plane < 6; plane++) {
+		// Trivial rejection: all three vertices outside the same frustum plane
+		if (dist(clipPos[0], plane, 1, 1) < 0 && dist(clipPos[1], plane, 1, 1) < 0 && dist(clipPos[2], plane, 1, 1) < 0) return 0;
+		for (int j = 0; j < 3; j++) {
+			if (dist(clipPos[j], plane, guardBandX, guardBandY) < 0) clipMask |= 1 << plane;
+		}
+	}
+
+	for (int j = 0; j < 3; j++) {
+		poly[j].pos = clipPos[j];
+		poly[j].bar = vec3(j == 0, j == 1, j == 2);
+	}
+	clipped = clipMask != 0;
+	if (!clipped) return 3;
+
+	// Sutherland-Hodgman against each plane the triangle crosses
+	ClipVertex buffer[MAX_CLIP_VERTICES];
+	ClipVertex* in = poly;
+	ClipVertex* out = buffer;
+	int n = 3;
+	for (int plane = 0; plane < 6 && n > 0; plane++) {
+		if (!(clipMask >> plane & 1)) continue;
+
+		int m = 0;
+		for (int k = 0; k < n; k++) {
+			const ClipVertex& cur = in[k];
+			const ClipVertex& next = in[(k + 1) % n];
+			float dCur = dist(cur.pos, plane, guardBandX, guardBandY);
+			float dNext = dist(next.pos, plane, guardBandX, guardBandY);
+			if (dCur >= 0) out[m++] = cur;
+			if ((dCur >= 0) != (dNext >= 0)) {
+				float t = dCur / (dCur - dNext);
+				out[m].pos = cur.pos + (next.pos - cur.pos) * t;
+				out[m].bar = cur.bar + (next.bar - cur.bar) * t;
+				m++;
 			}
+		}
+		std::swap(in, out);
+		n = m;
+	}
 
-			// Construct AABB
-			vec2 bboxmin(1e10, 1e10);
-			vec2 bboxmax(-1e10, -1e10);
+	if (in != poly) std::copy(in, in + n, poly);
+	return n;
+}
 
+bool Renderer::SetupTriangle(Triangle& tri, RenderStats& stats) const {
+	long long X[3], Y[3];
+	for (int j = 0; j < 3; j++) {
+		// Also rejects NaN coordinates of vertices at w = 0
+		if (!(std::abs(tri.screenPos[j].x) < GUARD_BAND && std::abs(tri.screenPos[j].y) < GUARD_BAND)) {
+			stats.frustumCulled++;
+			return false;
+		}
+		X[j] = std::llround(tri.screenPos[j].x * (1 << SUBPIXEL_BITS));
+		Y[j] = std::llround(tri.screenPos[j].y * (1 << SUBPIXEL_BITS));
+	}
+
+	// Counter-clockwise (positive area) is front facing
+	long long area2 = (X[1] - X[0]) * (Y[2] - Y[0]) - (X[2] - X[0]) * (Y[1] - Y[0]);
+	if (area2 == 0) {
+		stats.smallCulled++;
+		return false;
+	}
+	if ((cullMode == CullMode::BACK && area2 < 0) || (cullMode == CullMode::FRONT && area2 > 0)) {
+		stats.backfaceCulled++;
+		return false;
+	}
+
+	// Pixel centers sit on integer coordinates, a triangle whose bounds can't reach any
+	// of their samples is dropped
+	const long long one = 1LL << SUBPIXEL_BITS;
+	long long minX = std::min({ X[0], X[1], X[2] }) - sampleExtent, maxX = std::max({ X[0], X[1], X[2] }) + sampleExtent;
+	long long minY = std::min({ Y[0], Y[1], Y[2] }) - sampleExtent, maxY = std::max({ Y[0], Y[1], Y[2] }) + sampleExtent;
+	long long xmin = (minX + one - 1) >> SUBPIXEL_BITS, xmax = maxX >> SUBPIXEL_BITS;
+	long long ymin = (minY + one - 1) >> SUBPIXEL_BITS, ymax = maxY >> SUBPIXEL_BITS;
+	if (xmin > xmax || ymin > ymax) {
+		stats.smallCulled++;
+		return false;
+	}
+	tri.xmin = (int)std::max(xmin, 0LL);
+	tri.ymin = (int)std::max(ymin, 0LL);
+	tri.xmax = (int)std::min(xmax, width - 1LL);
+	tri.ymax = (int)std::min(ymax, height - 1LL);
+	if (tri.xmin > tri.xmax || tri.ymin > tri.ymax) {
+		stats.frustumCulled++;
+		return false;
+	}
+
+	// Clockwise triangles walk their edges backwards so that inside stays E_i >= 0
+	long long winding = area2 > 0 ? 1 : -1;
+	area2 *= winding;
+	for (int i = 0; i < 3; i++) {
+		int j = (i + 1) % 3, k = (i + 2) % 3;
+		long long dx = (X[k] - X[j]) * winding, dy = (Y[k] - Y[j]) * winding;
+		tri.edgeA[i] = -dy;
+		tri.edgeB[i] = dx;
+		tri.edgeC[i] = dy * X[j] - dx * Y[j];
+		// Counter-clockwise winding: left edges go down, top edges go left
+		bool topLeft = dy < 0 || (dy == 0 && dx < 0);
+		if (!topLeft) tri.edgeC[i] -= 1;
+		tri.invWArea[i] = tri.invW[i] / area2;
+		tri.invWDx[i] = (float)(tri.edgeA[i] * one * tri.invWArea[i]);
+		tri.invWDy[i] = (float)(tri.edgeB[i] * one * tri.invWArea[i]);
+	}
+
+	// Pulled slightly nearer, the per-pixel depth is interpolated in float and may round below it
+	tri.minDepth = (float)(1 / std::max({ tri.invW[0], tri.invW[1], tri.invW[2] })) * (1 - 1e-4f);
+
+	stats.trianglesRasterized++;
+	return true;
+}
+
+// Call f with the index of every screen tile the triangle's bounds overlap
+template<typename F> void Renderer::ForEachTile(const Triangle& tri, F&& f) const {
+	if (tri.xmin > tri.xmax || tri.ymin > tri.ymax) return;
+
+	for (int ty = tri.ymin / TILE_SIZE; ty <= tri.ymax / TILE_SIZE; ty++) {
+		for (int tx = tri.xmin / TILE_SIZE; tx <= tri.xmax / TILE_SIZE; tx++) {
+			f(tx + ty * tilesX);
+		}
+	}
+}
+
+// Returns whether any depth was written
+template<typename ShaderT> bool Renderer::RasterizeTriangle(const Triangle& tri, const ShaderT& shader, const int tileX, const int tileY) {
+	int xmin = std::max(tri.xmin, tileX * TILE_SIZE);
+	int ymin = std::max(tri.ymin, tileY * TILE_SIZE);
+	int xmax = std::min(tri.xmax, (tileX + 1) * TILE_SIZE - 1);
+	int ymax = std::min(tri.ymax, (tileY + 1) * TILE_SIZE - 1);
+
+	long long stepX[3], stepY[3];
+	for (int i = 0; i < 3; i++) {
+		stepX[i] = tri.edgeA[i] * (1LL << SUBPIXEL_BITS);
+		stepY[i] = tri.edgeB[i] * (1LL << SUBPIXEL_BITS);
+	}
+
+	bool written = false;
+	for (int by = ymin - ymin % BLOCK_SIZE; by <= ymax; by += BLOCK_SIZE) {
+		for (int bx = xmin - xmin % BLOCK_SIZE; bx <= xmax; bx += BLOCK_SIZE) {
+			int x0 = std::max(bx, xmin), x1 = std::min(bx + BLOCK_SIZE - 1, xmax);
+			int y0 = std::max(by, ymin), y1 = std::min(by + BLOCK_SIZE - 1, ymax);
+
+			// Test the block corners, widened by the sample offsets: skip it when one edge excludes
+			// all of them, drop the per-sample test when every edge includes all of them
+			long long rowE[3];
+			bool outside = false, inside = true;
 			for (int i = 0; i < 3; i++) {
-				bboxmin.x = screenPos[i].x < bboxmin.x ? screenPos[i].x : bboxmin.x;
-				bboxmin.y = screenPos[i].y < bboxmin.y ? screenPos[i].y : bboxmin.y;
-				bboxmax.x = screenPos[i].x > bboxmax.x ? screenPos[i].x : bboxmax.x;
-				bboxmax.y = screenPos[i].y > bboxmax.y ? screenPos[i].y : bboxmax.y;
+				rowE[i] = tri.edgeA[i] * ((long long)x0 << SUBPIXEL_BITS) + tri.edgeB[i] * ((long long)y0 << SUBPIXEL_BITS) + tri.edgeC[i];
+				long long dx = stepX[i] * (x1 - x0), dy = stepY[i] * (y1 - y0);
+				long long margin = (std::abs(tri.edgeA[i]) + std::abs(tri.edgeB[i])) * sampleExtent;
+				long long eMax = rowE[i] + std::max(dx, 0LL) + std::max(dy, 0LL) + margin;
+				long long eMin = rowE[i] + std::min(dx, 0LL) + std::min(dy, 0LL) - margin;
+				outside = outside || eMax < 0;
+				inside = inside && eMin >= 0;
 			}
-			bboxmin.x = 0 > bboxmin.x ? 0 : bboxmin.x;
-			bboxmin.y = 0 > bboxmin.y ? 0 : bboxmin.y;
-			bboxmax.x = (width - 1.) < bboxmax.x ? (width - 1.) : bboxmax.x;
-			bboxmax.y = (height - 1.) < bboxmax.y ? (height - 1.) : bboxmax.y;
+			if (outside) continue;
+			// The whole block already holds nearer geometry
+			if (tri.minDepth > blockMaxZ.GetValue(bx / BLOCK_SIZE, by / BLOCK_SIZE)) continue;
+			QS_PROFILE_COUNT(PIXELS_TESTED, (x1 - x0 + 1) * (y1 - y0 + 1));
 
-			// Rasterization
-#pragma omp parallel for
-			for (int x = (int)bboxmin.x; x <= (int)bboxmax.x; x++) {
-				for (int y = (int)bboxmin.y; y <= (int)bboxmax.y; y++) {
-					vec3 bc_screen = barycentric(screenPos, vec2(x, y));
-					vec3 bc_clip = vec3(bc_screen.x / clipPos[0][3], bc_screen.y / clipPos[1][3], bc_screen.z / clipPos[2][3]);
-					double frag_depth = 1 / (bc_clip.x + bc_clip.y + bc_clip.z);
-					bc_clip = bc_clip / (bc_clip.x + bc_clip.y + bc_clip.z);
-
-					if (bc_screen.x < 0 || bc_screen.y < 0 || bc_screen.z<0 || frag_depth > zBuffer.GetValue(x, y)) continue;
-					vec3 color;
-					if (shader.fragment(bc_clip, color)) continue;
-					zBuffer.SetValue(x, y, frag_depth);
-					frameBuffer.SetValue(x, y, color);
+			bool blockWritten = false;
+			for (int y = y0; y <= y1; y++) {
+				bool rowWritten;
+				if (sampleCount > 1) rowWritten = RasterizeRowMSAA(tri, shader, x0, x1, y, rowE, inside);
+				else switch (simdLevel) {
+				case SimdLevel::AVX2: rowWritten = RasterizeRowAVX2(tri, shader, x0, x1, y, rowE, inside); break;
+				case SimdLevel::SSE2: rowWritten = RasterizeRowSSE2(tri, shader, x0, x1, y, rowE, inside); break;
+				default: rowWritten = RasterizeRowScalar(tri, shader, x0, x1, y, rowE, inside); break;
 				}
+				blockWritten = blockWritten || rowWritten;
+				for (int i = 0; i < 3; i++) rowE[i] += stepY[i];
 			}
+			if (blockWritten) UpdateBlockMaxZ(bx / BLOCK_SIZE, by / BLOCK_SIZE);
+			written = written || blockWritten;
+		}
+	}
+	return written;
+}
+
+void Renderer::UpdateBlockMaxZ(const int bx, const int by) {
+	int x0 = bx * BLOCK_SIZE * sampleCount, x1 = std::min(bx * BLOCK_SIZE + BLOCK_SIZE, width) * sampleCount;
+	int y0 = by * BLOCK_SIZE, y1 = std::min(y0 + BLOCK_SIZE, height);
+	float zMax = 0;
+	for (int y = y0; y < y1; y++) {
+		const float* zSpan = zBuffer.GetSpan(x0, y);
+		for (int x = 0; x < x1 - x0; x++) zMax = std::max(zMax, zSpan[x]);
+	}
+	blockMaxZ.SetValue(bx, by, zMax);
+}
+
+template<typename ShaderT> bool Renderer::RasterizeRowScalar(const Triangle& tri, const ShaderT& shader, const int x0, const int x1, const int y, const long long rowE[3], const bool inside) {
+	long long e0 = rowE[0], e1 = rowE[1], e2 = rowE[2];
+	const long long stepX[3] = { tri.edgeA[0] * (1LL << SUBPIXEL_BITS), tri.edgeA[1] * (1LL << SUBPIXEL_BITS), tri.edgeA[2] * (1LL << SUBPIXEL_BITS) };
+	bool written = false;
+
+	for (int x = x0; x <= x1; x++) {
+		if (inside || (e0 | e1 | e2) >= 0) {
+			vec3 bc_clip = vec3(e0 * tri.invWArea[0], e1 * tri.invWArea[1], e2 * tri.invWArea[2]);
+			double invDepth = bc_clip.x + bc_clip.y + bc_clip.z;
+			float frag_depth = (float)(1 / invDepth);
+			if (frag_depth <= zBuffer.GetValue(x, y)) {
+				float bar[3] = { (float)(bc_clip.x / invDepth), (float)(bc_clip.y / invDepth), (float)(bc_clip.z / invDepth) };
+				const float* bars[3] = { &bar[0], &bar[1], &bar[2] };
+				written = ShadeLanes(tri, shader, x, y, 1, bars, &frag_depth) || written;
+			}
+		}
+		e0 += stepX[0];
+		e1 += stepX[1];
+		e2 += stepX[2];
+	}
+	return written;
+}
+
+// Coverage and depth per sample with the exact edge values, the fragment stage once per pixel at
+// its center, which may lie slightly outside the triangle when only some samples are covered
+template<typename ShaderT> bool Renderer::RasterizeRowMSAA(const Triangle& tri, const ShaderT& shader, const int x0, const int x1, const int y, const long long rowE[3], const bool inside) {
+	long long sampleE[3][MAX_SAMPLES];
+	long long e[3], stepX[3];
+	for (int i = 0; i < 3; i++) {
+		for (int s = 0; s < sampleCount; s++) sampleE[i][s] = tri.edgeA[i] * sampleOffsetX[s] + tri.edgeB[i] * sampleOffsetY[s];
+		e[i] = rowE[i];
+		stepX[i] = tri.edgeA[i] * (1LL << SUBPIXEL_BITS);
+	}
+	// The depth samples of the row's pixels, contiguous within the tile
+	const float* zSpan = zBuffer.GetSpan(x0 * sampleCount, y);
+	bool written = false;
+
+	for (int x = x0; x <= x1; x++) {
+		int coverage = 0;
+		float sampleDepth[MAX_SAMPLES];
+		for (int s = 0; s < sampleCount; s++) {
+			long long e0 = e[0] + sampleE[0][s], e1 = e[1] + sampleE[1][s], e2 = e[2] + sampleE[2][s];
+			if (!inside && (e0 | e1 | e2) < 0) continue;
+			sampleDepth[s] = (float)(1 / (e0 * tri.invWArea[0] + e1 * tri.invWArea[1] + e2 * tri.invWArea[2]));
+			if (sampleDepth[s] <= zSpan[(x - x0) * sampleCount + s]) coverage |= 1 << s;
+		}
+		if (coverage) {
+			float bar[3];
+			float depth = PerspectiveBarycentrics(tri, e, bar);
+			written = ShadeSamples(tri, shader, x, y, coverage, bar, depth, sampleDepth) || written;
 		}
+		for (int i = 0; i < 3; i++) e[i] += stepX[i];
+	}
+	return written;
+}
+
+// Shade one pixel and write it to its covered samples, returns whether any depth was written
+template<typename ShaderT> bool Renderer::ShadeSamples(const Triangle& tri, const ShaderT& shader, const int x, const int y, const int coverage, const float bar[3], const float depth, const float* sampleDepth) {
+	vec3 color;
+	QS_PROFILE_COUNT(DEPTH_PASSED, 1);
+	if (rasterPass == RasterPass::SHADE) {
+		const float* bars[3] = { &bar[0], &bar[1], &bar[2] };
+		if (!ShadeFragments(tri, shader, 1, bars, &depth, &color)) return false;
+	}
+
+	for (int s = 0; s < sampleCount; s++) {
+		if (!(coverage >> s & 1)) continue;
+		int xs = x * sampleCount + s;
+		zBuffer.SetValue(xs, y, sampleDepth[s]);
+		if (rasterPass == RasterPass::VISIBILITY) visibilityBuffer.SetValue(xs, y, tri.id);
+		else if (rasterPass == RasterPass::SHADE) sampleColors.SetValue(xs, y, color);
+	}
+	return true;
+}
+
+// Write the lanes that passed the depth test, returns whether any depth was written
+template<typename ShaderT> bool Renderer::ShadeLanes(const Triangle& tri, const ShaderT& shader, const int x, const int y, const int mask, const float* bar[3], const float* depth) {
+	int kept = mask;
+	vec3 color[8];
+	QS_PROFILE_COUNT(DEPTH_PASSED, BitCount(mask));
+	if (rasterPass == RasterPass::SHADE) kept = ShadeFragments(tri, shader, mask, bar, depth, color);
+
+	for (int i = 0; kept >> i; i++) {
+		if (!(kept >> i & 1)) continue;
+		zBuffer.SetValue(x + i, y, depth[i]);
+		if (rasterPass == RasterPass::VISIBILITY) visibilityBuffer.SetValue(x + i, y, tri.id);
+		else if (rasterPass == RasterPass::SHADE) frameBuffer.SetValue(x + i, y, PackColor(color[i]));
 	}
+	return kept != 0;
+}
 
-	TGAImage outputImage(width, height, TGAImage::RGB);
-	for (int x = 0; x < width; x++) {
-		for (int y = 0; y < height; y++) {
-			vec3 val = frameBuffer.GetValue(x, y);
-			TGAColor color(std::uint8_t(val.x * 255), std::uint8_t(val.y * 255), std::uint8_t(val.z * 255));
-			outputImage.set(x, y, color);
+// Run the fragment stage over up to 8 lanes, returns the lanes that were not discarded
+template<typename ShaderT> int Renderer::ShadeFragments(const Triangle& tri, const ShaderT& shader, const int mask, const float* bar[3], const float* depth, vec3* color) const {
+	vec3 bc[8], bcDx[8], bcDy[8];
+	float sumDx = tri.invWDx[0] + tri.invWDx[1] + tri.invWDx[2];
+	float sumDy = tri.invWDy[0] + tri.invWDy[1] + tri.invWDy[2];
+	for (int i = 0; mask >> i; i++) {
+		if (!(mask >> i & 1)) continue;
+		bc[i] = vec3(bar[0][i], bar[1][i], bar[2][i]);
+		// bar_k = e_k / sum(e), so d(bar_k) = (d(e_k) - bar_k * sum(d(e))) * w
+		for (int k = 0; k < 3; k++) {
+			bcDx[i][k] = (tri.invWDx[k] - bc[i][k] * sumDx) * depth[i];
+			bcDy[i][k] = (tri.invWDy[k] - bc[i][k] * sumDy) * depth[i];
 		}
 	}
-	outputImage.write_tga_file("output.tga");
+	QS_PROFILE_COUNT(FRAGMENTS_SHADED, BitCount(mask));
+	int kept = 0;
+	for (int i = 0; mask >> i; i++) {
+		if ((mask >> i & 1) && !shader.fragment(tri.varyings, bc[i], bcDx[i], bcDy[i], color[i])) kept |= 1 << i;
+	}
+	return kept;
+}
+
+// Deferred shading pass: rebuild the barycentrics of each visible triangle from its edge
+// functions and shade runs of up to 8 neighbouring pixels that share a triangle together.
+// A discarding shader leaves its pixel empty, it can't reveal what was behind it.
+// The shader is dispatched once per run through the draw's type-erased entry point
+void Renderer::ShadeVisibilityBuffer() {
+	const int LANES = 8;
+#pragma omp parallel for schedule(dynamic)
+	for (int y = 0; y < height; y++) {
+		const int* ids = visibilityBuffer.GetRow(y);
+		for (int x = 0; x < width;) {
+			int id = ids[x];
+			if (id < 0) {
+				frameBuffer.SetValue(x, y, 0);
+				x++;
+				continue;
+			}
+			int n = 1;
+			while (n < LANES && x + n < width && ids[x + n] == id) n++;
 
-	return;
+			const Triangle& tri = *triangles[id];
+			float bar[3][LANES], depth[LANES];
+			for (int i = 0; i < n; i++) {
+				long long E[3];
+				for (int k = 0; k < 3; k++) {
+					E[k] = tri.edgeA[k] * ((long long)(x + i) << SUBPIXEL_BITS) + tri.edgeB[k] * ((long long)y << SUBPIXEL_BITS) + tri.edgeC[k];
+				}
+				float b[3];
+				depth[i] = PerspectiveBarycentrics(tri, E, b);
+				for (int k = 0; k < 3; k++) bar[k][i] = b[k];
+			}
+			const float* bars[3] = { bar[0], bar[1], bar[2] };
+			vec3 color[LANES];
+			const DrawCall& call = drawCalls[tri.drawIndex];
+			int kept = (this->*call.shadeFragments)(tri, *call.shader, (1 << n) - 1, bars, depth, color);
+			for (int i = 0; i < n; i++) {
+				frameBuffer.SetValue(x + i, y, (kept >> i & 1) ? PackColor(color[i]) : 0);
+			}
+			x += n;
+		}
+	}
 }
 
-mat<4, 4> Renderer::GetModelMatrix(const Model& model) const {
-	return mat<4, 4>::identity();
+// Multisampled deferred shading: each pixel is shaded once per distinct triangle among its
+// samples, at the pixel center, and the color goes to the samples holding that triangle
+void Renderer::ShadeVisibilitySamples() {
+#pragma omp parallel for schedule(dynamic)
+	for (int y = 0; y < height; y++) {
+		const int* ids = visibilityBuffer.GetRow(y);
+		vec3* colors = sampleColors.GetRow(y);
+		for (int x = 0; x < width; x++) {
+			const int* pixel = ids + x * sampleCount;
+			int done = 0;
+			for (int s = 0; s < sampleCount; s++) {
+				if (pixel[s] < 0) colors[x * sampleCount + s] = vec3(0, 0, 0);
+				if ((done >> s & 1) || pixel[s] < 0) continue;
+				int samples = 0;
+				for (int t = s; t < sampleCount; t++) {
+					if (pixel[t] == pixel[s]) samples |= 1 << t;
+				}
+				done |= samples;
+
+				const Triangle& tri = *triangles[pixel[s]];
+				long long E[3];
+				for (int k = 0; k < 3; k++) {
+					E[k] = tri.edgeA[k] * ((long long)x << SUBPIXEL_BITS) + tri.edgeB[k] * ((long long)y << SUBPIXEL_BITS) + tri.edgeC[k];
+				}
+				float bar[3];
+				float depth = PerspectiveBarycentrics(tri, E, bar);
+				const float* bars[3] = { &bar[0], &bar[1], &bar[2] };
+				vec3 color;
+				const DrawCall& call = drawCalls[tri.drawIndex];
+				if (!(this->*call.shadeFragments)(tri, *call.shader, 1, bars, &depth, &color)) color = vec3(0, 0, 0);
+				for (int t = s; t < sampleCount; t++) {
+					if (samples >> t & 1) colors[x * sampleCount + t] = color;
+				}
+			}
+		}
+	}
+}
+
+// Box filter the samples of each pixel into the frame buffer
+void Renderer::ResolveSamples() {
+	const float weight = 1.f / sampleCount;
+#pragma omp parallel for
+	for (int y = 0; y < height; y++) {
+		const vec3* src = sampleColors.GetRow(y);
+		std::uint32_t* dst = frameBuffer.GetRow(y);
+		for (int x = 0; x < width; x++) {
+			vec3 sum(0, 0, 0);
+			for (int s = 0; s < sampleCount; s++) sum = sum + src[x * sampleCount + s];
+			dst[x] = PackColor(sum * weight);
+		}
+	}
+}
+
+// The SIMD rows test coverage on the exact 64-bit edge values (a lane is outside when the sign
+// bit of E0 | E1 | E2 is set), and interpolate 1/w and the barycentrics in float lanes from
+// planes evaluated in double at the start of the row.
+
+template<typename ShaderT> bool Renderer::RasterizeRowSSE2(const Triangle& tri, const ShaderT& shader, const int x0, const int x1, const int y, const long long rowE[3], const bool inside) {
+#if defined(QS_SSE2)
+	const int LANES = 4;
+	const float* zSpan = zBuffer.GetSpan(x0, y);
+	bool written = false;
+	__m128i eLo[3], eHi[3], eStep[3];
+	__m128 p[3], pStep[3];
+
+	for (int i = 0; i < 3; i++) {
+		long long s = tri.edgeA[i] * (1LL << SUBPIXEL_BITS);
+		eLo[i] = _mm_set_epi64x(rowE[i] + s, rowE[i]);
+		eHi[i] = _mm_set_epi64x(rowE[i] + 3 * s, rowE[i] + 2 * s);
+		eStep[i] = _mm_set1_epi64x(LANES * s);
+		float dp = (float)(s * tri.invWArea[i]);
+		p[i] = _mm_add_ps(_mm_set1_ps((float)(rowE[i] * tri.invWArea[i])), _mm_mul_ps(_mm_setr_ps(0, 1, 2, 3), _mm_set1_ps(dp)));
+		pStep[i] = _mm_set1_ps(LANES * dp);
+	}
+
+	for (int x = x0; x <= x1; x += LANES) {
+		int n = std::min(LANES, x1 - x + 1);
+		int mask = (1 << n) - 1;
+		if (!inside) {
+			__m128i lo = _mm_or_si128(_mm_or_si128(eLo[0], eLo[1]), eLo[2]);
+			__m128i hi = _mm_or_si128(_mm_or_si128(eHi[0], eHi[1]), eHi[2]);
+			mask &= ~(_mm_movemask_pd(_mm_castsi128_pd(lo)) | _mm_movemask_pd(_mm_castsi128_pd(hi)) << 2);
+		}
+		if (mask) {
+			__m128 depth = _mm_div_ps(_mm_set1_ps(1), _mm_add_ps(_mm_add_ps(p[0], p[1]), p[2]));
+			float zTmp[LANES] = {};
+			std::memcpy(zTmp, zSpan + (x - x0), n * sizeof(float));
+			mask &= _mm_movemask_ps(_mm_cmple_ps(depth, _mm_loadu_ps(zTmp)));
+			if (mask) {
+				alignas(16) float bar[3][LANES], d[LANES];
+				for (int i = 0; i < 3; i++) _mm_store_ps(bar[i], _mm_mul_ps(p[i], depth));
+				_mm_store_ps(d, depth);
+				const float* bars[3] = { bar[0], bar[1], bar[2] };
+				written = ShadeLanes(tri, shader, x, y, mask, bars, d) || written;
+			}
+		}
+		for (int i = 0; i < 3; i++) {
+			eLo[i] = _mm_add_epi64(eLo[i], eStep[i]);
+			eHi[i] = _mm_add_epi64(eHi[i], eStep[i]);
+			p[i] = _mm_add_ps(p[i], pStep[i]);
+		}
+	}
+	return written;
+#else
+	return RasterizeRowScalar(tri, shader, x0, x1, y, rowE, inside);
+#endif
+}
+
+template<typename ShaderT> QS_TARGET_AVX2 bool Renderer::RasterizeRowAVX2(const Triangle& tri, const ShaderT& shader, const int x0, const int x1, const int y, const long long rowE[3], const bool inside) {
+#if defined(QS_SSE2)
+	const int LANES = 8;
+	const float* zSpan = zBuffer.GetSpan(x0, y);
+	bool written = false;
+	__m256i eLo[3], eHi[3], eStep[3];
+	__m256 p[3], pStep[3];
+
+	for (int i = 0; i < 3; i++) {
+		long long s = tri.edgeA[i] * (1LL << SUBPIXEL_BITS);
+		eLo[i] = _mm256_setr_epi64x(rowE[i], rowE[i] + s, rowE[i] + 2 * s, rowE[i] + 3 * s);
+		eHi[i] = _mm256_add_epi64(eLo[i], _mm256_set1_epi64x(4 * s));
+		eStep[i] = _mm256_set1_epi64x(LANES * s);
+		float dp = (float)(s * tri.invWArea[i]);
+		p[i] = _mm256_add_ps(_mm256_set1_ps((float)(rowE[i] * tri.invWArea[i])), _mm256_mul_ps(_mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_ps(dp)));
+		pStep[i] = _mm256_set1_ps(LANES * dp);
+	}
+
+	for (int x = x0; x <= x1; x += LANES) {
+		int n = std::min(LANES, x1 - x + 1);
+		int mask = (1 << n) - 1;
+		if (!inside) {
+			__m256i lo = _mm256_or_si256(_mm256_or_si256(eLo[0], eLo[1]), eLo[2]);
+			__m256i hi = _mm256_or_si256(_mm256_or_si256(eHi[0], eHi[1]), eHi[2]);
+			mask &= ~(_mm256_movemask_pd(_mm256_castsi256_pd(lo)) | _mm256_movemask_pd(_mm256_castsi256_pd(hi)) << 4);
+		}
+		if (mask) {
+			__m256 depth = _mm256_div_ps(_mm256_set1_ps(1), _mm256_add_ps(_mm256_add_ps(p[0], p[1]), p[2]));
+			__m256 z;
+			if (n == LANES) {
+				z = _mm256_loadu_ps(zSpan + (x - x0));
+			}
+			else {
+				float zTmp[LANES] = {};
+				std::memcpy(zTmp, zSpan + (x - x0), n * sizeof(float));
+				z = _mm256_loadu_ps(zTmp);
+			}
+			mask &= _mm256_movemask_ps(_mm256_cmp_ps(depth, z, _CMP_LE_OQ));
+			if (mask) {
+				alignas(32) float bar[3][LANES], d[LANES];
+				for (int i = 0; i < 3; i++) _mm256_store_ps(bar[i], _mm256_mul_ps(p[i], depth));
+				_mm256_store_ps(d, depth);
+				const float* bars[3] = { bar[0], bar[1], bar[2] };
+				written = ShadeLanes(tri, shader, x, y, mask, bars, d) || written;
+			}
+		}
+		for (int i = 0; i < 3; i++) {
+			eLo[i] = _mm256_add_epi64(eLo[i], eStep[i]);
+			eHi[i] = _mm256_add_epi64(eHi[i], eStep[i]);
+			p[i] = _mm256_add_ps(p[i], pStep[i]);
+		}
+	}
+	return written;
+#else
+	return RasterizeRowScalar(tri, shader, x0, x1, y, rowE, inside);
+#endif
+}
+
+void Renderer::SetCullMode(CullMode mode) {
+	cullMode = mode;
+}
+
+void Renderer::SetShadingMode(ShadingMode mode) {
+	shadingMode = mode;
+}
+
+void Renderer::SetDepthPrepass(bool enable) {
+	depthPrepass = enable;
+}
+
+bool Renderer::SetSampleCount(const int samples) {
+	const int (*pattern)[2];
+	switch (samples) {
+	case 1: pattern = SAMPLE_PATTERN_1; break;
+	case 2: pattern = SAMPLE_PATTERN_2; break;
+	case 4: pattern = SAMPLE_PATTERN_4; break;
+	case 8: pattern = SAMPLE_PATTERN_8; break;
+	default: return false;
+	}
+
+	sampleCount = samples;
+	sampleExtent = 0;
+	for (int s = 0; s < samples; s++) {
+		sampleOffsetX[s] = pattern[s][0] * (1LL << (SUBPIXEL_BITS - 4));
+		sampleOffsetY[s] = pattern[s][1] * (1LL << (SUBPIXEL_BITS - 4));
+		sampleExtent = std::max({ sampleExtent, std::abs(sampleOffsetX[s]), std::abs(sampleOffsetY[s]) });
+	}
+	// The samples of a pixel are adjacent, a tile's row holds TILE_SIZE pixels' worth
+	zBuffer = Buffer<float>(width * samples, height, 1e10f, TILE_SIZE * samples, TILE_SIZE, BufferLayout::TILED);
+	visibilityBuffer = Buffer<int>(width * samples, height, -1, TILE_SIZE * samples, TILE_SIZE);
+	sampleColors = samples > 1 ? Buffer<vec3>(width * samples, height, vec3(0, 0, 0), TILE_SIZE * samples, TILE_SIZE) : Buffer<vec3>();
+	return true;
+}
+
+void Renderer::SetShadows(const bool enable, const int size) {
+	if (!enable) shadowMap.reset();
+	else if (!shadowMap || shadowMap->GetSize() != size) shadowMap = std::make_unique<ShadowMap>(size);
+}
+
+const ShadowMap* Renderer::GetShadowMap() const {
+	return shadowMap.get();
+}
+
+const RenderStats& Renderer::GetStats() const {
+	return stats;
+}
+
+FrameArena& Renderer::GetFrameArena() {
+	return frameArena;
+}
+
+mat<4, 4> Renderer::GetModelMatrix(const Model& model, const int instance) const {
+	Model::Transform transform = model.GetInstance(instance);
+	const float DEGREE = 3.14159265f / 180;
+
+	mat<4, 4> matrix = mat<4, 4>::identity();
+	for (int i = 0; i < 3; i++) matrix[i][i] = transform.scale[i];
+	// Rotate about x, then y, then z
+	for (int axis = 0; axis < 3; axis++) {
+		float angle = transform.rotation[axis] * DEGREE;
+		if (angle == 0) continue;
+		int u = (axis + 1) % 3, v = (axis + 2) % 3;
+		mat<4, 4> rotation = mat<4, 4>::identity();
+		rotation[u][u] = rotation[v][v] = std::cos(angle);
+		rotation[u][v] = -std::sin(angle);
+		rotation[v][u] = std::sin(angle);
+		matrix = rotation * matrix;
+	}
+	for (int i = 0; i < 3; i++) matrix[i][3] = transform.position[i];
+	return matrix;
 }
 
 mat<4, 4> Renderer::GetCameraViewMatrix() const {
@@ -114,13 +1133,13 @@ mat<4, 4> Renderer::GetCameraViewMatrix() const {
 }
 
 mat<4, 4> Renderer::GetCameraProjectMatrix() const {
-	double fovY = camera.fovY;
-	double aspect = camera.aspect;
-	double zNear = camera.zNear;
-	double zFar = camera.zFar;
+	float fovY = camera.fovY;
+	float aspect = camera.aspect;
+	float zNear = camera.zNear;
+	float zFar = camera.zFar;
 
-	const double t = tan(fovY / 2) * zNear;
-	const double r = t * aspect;
+	const float t = std::tan(fovY / 2) * zNear;
+	const float r = t * aspect;
 	mat<4, 4> projectMatrix = { {
 		{zNear / r, 0, 0, 0},
 		{0, zNear / t, 0, 0},
@@ -140,8 +1159,8 @@ vec3 Renderer::GetWorldSpaceLightDir() const {
 
 mat<4, 4> Renderer::GetViewportMatrix() const {
 	return mat<4, 4> { {
-		{ width / 2.0, 0, 0, width / 2.0},
-		{ 0, height / 2.0, 0, height / 2.0 },
+		{ width / 2.f, 0, 0, width / 2.f},
+		{ 0, height / 2.f, 0, height / 2.f },
 		{ 0, 0, 1, 0 },
 		{ 0, 0, 0, 1 }
 		} };
@@ -153,13 +1172,60 @@ vec3 Renderer::barycentric(const vec2 tri[3], const vec2 P) const {
 	return tmpMatrix.invert_transpose() * embed<3>(P);
 }
 
-void Renderer::GetTexture(const Model& model, const std::string suffix, TGAImage& output_img) {
+static std::string TexturePath(const Model& model, const std::string& suffix) {
 	std::string filename = model.GetFilename();
 	size_t dot = filename.find_last_of(".");
-	if (dot == std::string::npos) return;
-	std::string texfile = filename.substr(0, dot) + suffix;
-	bool ok = output_img.read_tga_file(texfile.c_str());
-	std::cerr << "texture file " << texfile << " loading " << (ok ? "ok" : "failed") << std::endl;
-	if (!ok) exit(0);
+	if (dot == std::string::npos) return "";
+	return filename.substr(0, dot) + suffix;
+}
+
+std::shared_ptr<const Texture> Renderer::GetTexture(const Model& model, const std::string suffix, const TGAColor& fallback) {
+	// Kept per model, the shaders of the following frames skip building the path
+	std::shared_ptr<const Texture>& texture = modelTextures[std::make_pair(&model, suffix)];
+	if (texture) return texture;
+	std::string texfile = TexturePath(model, suffix);
+	texture = texfile.empty() ? nullptr : textureCache.Get(texfile);
+	if (texture) return texture;
+	TGAImage fallbackImage(1, 1, TGAImage::RGB);
+	fallbackImage.set(0, 0, fallback);
+	texture = std::make_shared<Texture>(fallbackImage);
+	return texture;
 }
 
+void Renderer::PreloadTextures() {
+	// Nothing new to load while the models and their shaders are the ones of the last call
+	bool unchanged = preloadedShaders.size() == modelArray.size();
+	for (size_t i = 0; unchanged && i < modelArray.size(); i++) {
+		auto it = modelShaders.find(modelArray[i]);
+		unchanged = preloadedShaders[i].first == modelArray[i] && preloadedShaders[i].second == (it == modelShaders.end() ? 0 : it->second);
+	}
+	if (unchanged) return;
+
+	preloadedShaders.clear();
+	std::vector<std::string> paths;
+	for (const Model* model : modelArray) {
+		auto it = modelShaders.find(model);
+		preloadedShaders.emplace_back(model, it == modelShaders.end() ? 0 : it->second);
+		for (const std::string& suffix : SHADER_REGISTRY[it == modelShaders.end() ? 0 : it->second].textures) {
+			std::string texfile = TexturePath(*model, suffix);
+			if (!texfile.empty()) paths.push_back(texfile);
+		}
+	}
+	textureCache.Preload(paths);
+}
+
+bool Renderer::SetModelShader(const Model& model, const std::string& name) {
+	for (int i = 0; i < SHADER_REGISTRY_SIZE; i++) {
+		if (name == SHADER_REGISTRY[i].name) {
+			modelShaders[&model] = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+std::vector<std::string> Renderer::GetShaderNames() {
+	std::vector<std::string> names;
+	for (const ShaderEntry& entry : SHADER_REGISTRY) names.push_back(entry.name);
+	return names;
+}
@@ -1,5 +1,10 @@
 #pragma once
 
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 #include "geometry.h"
 #include "tgaimage.h"
@@ -7,22 +12,210 @@
 #include "camera.h"
 #include "light.h"
 #include "model.h"
+#include "cpu.h"
+#include "texturecache.h"
+#include "imagewriter.h"
+#include "shadowmap.h"
+#include "profiler.h"
+#include "arena.h"
+
+class Shader;
+struct Triangle;
+struct ClipVertex;
+struct DrawCall;
+
+// Which winding, after the viewport transform, is discarded
+enum class CullMode { NONE, BACK, FRONT };
+
+// Forward shades every fragment that passes the depth test. Deferred first rasterizes depth and
+// triangle ids into a visibility buffer, then shades each covered pixel exactly once
+enum class ShadingMode { FORWARD, DEFERRED };
+
+// Per-frame pipeline counters
+struct RenderStats {
+	// Model instances and meshlets dropped before vertex processing
+	long long modelsCulled = 0;
+	long long meshletsFrustumCulled = 0;
+	long long meshletsConeCulled = 0;
+	long long facesSubmitted = 0;
+	long long frustumCulled = 0;
+	long long backfaceCulled = 0;
+	long long smallCulled = 0;
+	long long trianglesRasterized = 0;
+	// Triangle-tile pairs skipped because the triangle lies behind the tile's farthest depth
+	long long hiZCulled = 0;
+	// Faces of every instance drawn, and those of them dropped before rasterization: with their
+	// model or meshlet, or because no triangle of their clipped fan survived setup
+	long long facesDrawn = 0;
+	long long facesCulled = 0;
+
+	RenderStats& operator+=(const RenderStats& other) {
+		modelsCulled += other.modelsCulled;
+		meshletsFrustumCulled += other.meshletsFrustumCulled;
+		meshletsConeCulled += other.meshletsConeCulled;
+		facesSubmitted += other.facesSubmitted;
+		frustumCulled += other.frustumCulled;
+		backfaceCulled += other.backfaceCulled;
+		smallCulled += other.smallCulled;
+		trianglesRasterized += other.trianglesRasterized;
+		hiZCulled += other.hiZCulled;
+		facesDrawn += other.facesDrawn;
+		facesCulled += other.facesCulled;
+		return *this;
+	}
+};
 
 class Renderer {
+	static const int TILE_SIZE = 32;
+	static const int BLOCK_SIZE = 8;
+	static const int SUBPIXEL_BITS = 8;
+	static const int GUARD_BAND = 1 << 16;
+	static const int MAX_CLIP_VERTICES = 9;
+	static const int MAX_SAMPLES = 8;
+
 	Camera &camera;
 	Light &light;
 	std::vector<Model*> &modelArray;
 
 	int width, height;
-	Buffer<double> zBuffer;
-	Buffer<vec3> frameBuffer;
+	// Depth per sample in the tiled layout, the samples of a pixel are adjacent in its row
+	Buffer<float> zBuffer;
+	// Shaded color as RGBA8, red in the lowest byte
+	Buffer<std::uint32_t> frameBuffer;
+	// Deferred mode G-buffer: index of the visible triangle per sample, -1 when empty
+	Buffer<int> visibilityBuffer;
+
+	// Multisampling: sample offsets from the pixel center and their largest extent in subpixel
+	// units, and the shaded color per sample that EndFrame averages into the frame buffer
+	int sampleCount = 1;
+	long long sampleOffsetX[MAX_SAMPLES] = {}, sampleOffsetY[MAX_SAMPLES] = {};
+	long long sampleExtent = 0;
+	Buffer<vec3> sampleColors;
+
+	// Hierarchical Z: farthest depth of each 8x8 block and of each tile, kept conservative
+	// (never nearer than the zBuffer) and refreshed after a triangle writes depth
+	Buffer<float> blockMaxZ;
+	Buffer<float> tileMaxZ;
+
+	int tilesX, tilesY;
+
+	SimdLevel simdLevel;
+
+	// Guard band half extents in NDC, triangles are only clipped in x/y beyond them
+	float guardBandX, guardBandY;
+
+	CullMode cullMode = CullMode::BACK;
+	ShadingMode shadingMode = ShadingMode::FORWARD;
+	bool depthPrepass = false;
+
+	// What the rasterizer writes for the covered fragments that pass the depth test
+	enum class RasterPass { DEPTH, VISIBILITY, SHADE };
+	RasterPass rasterPass = RasterPass::SHADE;
+	RenderStats stats;
+
+	// Transient data of the frame: shaders, vertex caches, triangles and tile bins. Reset by
+	// BeginFrame, declared before drawCalls so that it outlives the shaders living in it
+	FrameArena frameArena;
+
+	// Frame state between BeginFrame and EndFrame. Deferred shading and the depth prepass
+	// keep every draw's shader and triangles until the end of the frame. The triangles live in
+	// the frame arena, the list keeps its capacity from frame to frame
+	std::vector<Triangle*> triangles;
+	std::vector<DrawCall> drawCalls;
+	bool keepTriangles = false;
+
+	// Index into the shader registry per model, models not listed use the first entry
+	std::map<const Model*, int> modelShaders;
+
+	// Meshlets of the model instance being drawn that survived culling
+	std::vector<int> visibleMeshlets;
+
+	TextureCache textureCache;
+	// Textures handed to the shaders per model and file suffix, and the model and shader pairs
+	// PreloadTextures last loaded for
+	std::map<std::pair<const Model*, std::string>, std::shared_ptr<const Texture>> modelTextures;
+	std::vector<std::pair<const Model*, int>> preloadedShaders;
+
+	// Depth from the light, rendered at the start of each frame while shadows are enabled
+	std::unique_ptr<ShadowMap> shadowMap;
+
+	// Writer thread and sink that RenderMainFun hands resolved frames to
+	std::unique_ptr<ImageWriter> output;
+
+	int ClipTriangle(const vec4 clipPos[3], ClipVertex* poly, bool& clipped) const;
+
+	bool CullMeshlets(const Model&, const mat<4, 4>& modelMatrix);
+	void ProcessGeometry(const Shader&, const int drawIndex);
+	bool SetupTriangle(Triangle&, RenderStats&) const;
+	template<typename F> void ForEachTile(const Triangle&, F&&) const;
+	void UpdateBlockMaxZ(const int bx, const int by);
+
+	// The raster stages are instantiated per shader type so the fragment stage is inlined
+	template<typename ShaderT> void RasterizeTiles(const int firstTriangle, const int endTriangle, const ShaderT&);
+	template<typename ShaderT> bool RasterizeTriangle(const Triangle&, const ShaderT&, const int tileX, const int tileY);
+	template<typename ShaderT> bool RasterizeRowScalar(const Triangle&, const ShaderT&, const int x0, const int x1, const int y, const long long rowE[3], const bool inside);
+	template<typename ShaderT> bool RasterizeRowSSE2(const Triangle&, const ShaderT&, const int x0, const int x1, const int y, const long long rowE[3], const bool inside);
+	template<typename ShaderT> bool RasterizeRowAVX2(const Triangle&, const ShaderT&, const int x0, const int x1, const int y, const long long rowE[3], const bool inside);
+	template<typename ShaderT> bool RasterizeRowMSAA(const Triangle&, const ShaderT&, const int x0, const int x1, const int y, const long long rowE[3], const bool inside);
+	template<typename ShaderT> bool ShadeLanes(const Triangle&, const ShaderT&, const int x, const int y, const int mask, const float* bar[3], const float* depth);
+	template<typename ShaderT> bool ShadeSamples(const Triangle&, const ShaderT&, const int x, const int y, const int coverage, const float bar[3], const float depth, const float* sampleDepth);
+	template<typename ShaderT> int ShadeFragments(const Triangle&, const ShaderT&, const int mask, const float* bar[3], const float* depth, vec3* color) const;
+	// Type-erased entry points stored in a DrawCall for the passes run at the end of the frame
+	template<typename ShaderT> void RasterizeDraw(const DrawCall&);
+	template<typename ShaderT> int ShadeDrawFragments(const Triangle&, const Shader&, const int mask, const float* bar[3], const float* depth, vec3* color) const;
+	void ShadeVisibilityBuffer();
+	void ShadeVisibilitySamples();
+	void RenderShadowMap();
+	void ResolveSamples();
 
 public :
 	Renderer(Camera&, Light&, std::vector<Model*>&, int, int);
+	~Renderer();
 
+	// Draw every model with its registered shader and queue the image on the output sink,
+	// output.tga when none is set. Rendering only waits when the sink's queue is full
 	void RenderMainFun();
+	// Draw every model into the frame buffer, reusing the buffers, shaders' textures and models
+	void RenderFrame();
+	// The frame buffer as an 8-bit image, converted row by row in parallel
+	RGBImage ResolveImage() const;
+	// Same into an image of the renderer's size
+	void ResolveImage(RGBImage& image) const;
+
+	// Replace the output sink, after writing every frame queued on the previous one
+	void SetOutputSink(std::unique_ptr<FrameSink> sink, const int maxQueued = 2);
+	// Wait for the queued frames, returns how many could not be written so far
+	int FlushOutput();
+
+	// Clears the frame's buffers, and renders the shadow map when shadows are enabled
+	void BeginFrame();
+	// Transform, clip, bin and rasterize every instance of one model with the shader type ShaderT,
+	// as a single draw sharing one shader and its textures
+	template<typename ShaderT> void Draw(Model&);
+	// Run the passes deferred to the end of the frame
+	void EndFrame();
+
+	// Pick a registered shader ("blinnphong", "bump") for a model, false for an unknown name
+	bool SetModelShader(const Model&, const std::string& name);
+	static std::vector<std::string> GetShaderNames();
+
+	void SetCullMode(CullMode mode);
+	void SetShadingMode(ShadingMode mode);
+	// Rasterize all models depth-only before shading, forward mode only
+	void SetDepthPrepass(bool enable);
+	// Samples per pixel: 1, 2, 4 or 8, false for any other count. Coverage and depth are tested
+	// per sample while the fragment stage runs once per pixel and triangle
+	bool SetSampleCount(const int samples);
+	// Shadows from the directional light through a size x size shadow map
+	void SetShadows(const bool enable, const int size = 2048);
+	// nullptr while shadows are disabled
+	const ShadowMap* GetShadowMap() const;
+	const RenderStats& GetStats() const;
+	// Allocator of the frame's transient data, for the shaders
+	FrameArena& GetFrameArena();
 
-	mat<4, 4> GetModelMatrix(const Model&) const;
+	// Object to world transform of one of the model's instances
+	mat<4, 4> GetModelMatrix(const Model&, const int instance = 0) const;
 
 	mat<4, 4> GetCameraViewMatrix() const;
 	mat<4, 4> GetCameraProjectMatrix() const;
@@ -31,7 +224,11 @@ public :
 	vec3 GetWorldSpaceLightDir() const;
 	mat<4, 4> GetViewportMatrix() const;
 
-	void GetTexture(const Model&, const std::string suffix, TGAImage& output_img);
+	// Texture next to the model's obj file, shared through the texture cache.
+	// A missing file gives a 1x1 texture of the fallback color
+	std::shared_ptr<const Texture> GetTexture(const Model&, const std::string suffix, const TGAColor& fallback);
+	// Load the textures of every model's shader in parallel
+	void PreloadTextures();
 
 	vec3 barycentric(const vec2*, const vec2) const;
-};
\ No newline at end of file
+};
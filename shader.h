@@ -1,155 +1,207 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <vector>
 #include "geometry.h"
 #include "renderer.h"
-#include "tgaimage.h"
+#include "texture.h"
 
 class Shader {
 protected:
 	Model& model;
 	mat<4, 4> modelMatrix;
+	mat<4, 4> normalMatrix;
 	mat<4, 4> mvpMatrix;
+	mat<4, 4> viewProjMatrix;
 	vec3 worldSpaceLightDir;
 	vec3 cameraPos;
+	const ShadowMap* shadowMap;
+	// The renderer's frame arena, a shader lives for one frame at most
+	Arena& arena;
+
+	// Post-transform cache, indexed like the model's welded vertices, allocated on the first
+	// ProcessVertices and reused by every instance
+	vec4* cache_clipPos = nullptr;
+	vec3* cache_worldPos = nullptr;
+	vec3* cache_worldNormal = nullptr;
+	// Welded vertices referenced by the meshlets being drawn, and a flag per welded vertex
+	int* activeVertices = nullptr;
+	int activeCount = 0;
+	std::uint8_t* active = nullptr;
 
 public :
-	vec3 saturate(vec3 vec) {
+	// Per-triangle interpolants, one column per vertex
+	struct Varyings {
+		mat<2, 3> uv;
+		mat<3, 3> worldNormal;
+		mat<3, 3> worldPos;
+
+		// Varyings of a sub-triangle whose vertex k has barycentric coordinates bar.col(k)
+		Varyings Sub(const mat<3, 3>& bar) const {
+			return { uv * bar, worldNormal * bar, worldPos * bar };
+		}
+	};
+
+	vec3 saturate(vec3 vec) const {
 		return vec3(saturate(vec.x), saturate(vec.y), saturate(vec.z));
 	}
-	double saturate(double x) {
-		if (x < 0) return 0.0;
-		else if (x >= 1.) return 0.9998;
+	float saturate(float x) const {
+		if (x < 0) return 0.f;
+		else if (x >= 1.f) return 0.9998f;
 		return x;
 	}
-	vec3 tex2D(TGAImage& tex, vec2 pos) {
-		int x = (int)(saturate(pos.x) * tex.width());
-		int y = (int)(saturate(pos.y) * tex.height());
-		TGAColor color = tex.get(x, y);
-		return vec3((double)color[2] / 255, (double)color[1] / 255, (double)color[0] / 255);
+	// Trilinear sample, ddx and ddy are the screen-space derivatives of uv
+	vec3 tex2D(const Texture& tex, vec2 uv, vec2 ddx, vec2 ddy) const {
+		return proj<3>(tex.Sample(uv, ddx, ddy));
 	}
-	vec3 PackNormal(TGAImage& tex, vec2 pos) {
-		vec3 val = tex2D(tex, pos);
+	vec3 PackNormal(const Texture& tex, vec2 uv, vec2 ddx, vec2 ddy) const {
+		vec3 val = tex2D(tex, uv, ddx, ddy);
 		return val * 2 - vec3(1, 1, 1);
 	}
+	// Fraction of the directional light reaching the point, 1 without a shadow map
+	float Shadow(const vec3& worldPos, const vec3& worldNormal) const {
+		return shadowMap ? shadowMap->Visibility(worldPos, worldNormal) : 1.f;
+	}
 
-	Shader(Renderer& renderer, Model& model) : model(model) {
-		modelMatrix = renderer.GetModelMatrix(model);
-		mvpMatrix = renderer.GetCameraProjectMatrix() * renderer.GetCameraViewMatrix() * modelMatrix;
+	Shader(Renderer& renderer, Model& model) : model(model), arena(renderer.GetFrameArena().Get()) {
+		viewProjMatrix = renderer.GetCameraProjectMatrix() * renderer.GetCameraViewMatrix();
+		SetModelMatrix(renderer.GetModelMatrix(model));
 		worldSpaceLightDir = renderer.GetWorldSpaceLightDir();
 		cameraPos = renderer.GetCameraPos();
+		shadowMap = renderer.GetShadowMap();
 	}
-	
-	virtual bool fragment(vec3 bar, vec3& out_color) = 0;
-};
+	virtual ~Shader() = default;
 
-class BlinnPhongShader : public Shader {
-	TGAImage mainTexture;
-	TGAImage specTexture;
-
-	vec3 input_vertex;
-	vec3 input_normal;
-	vec2 input_texcoord;
+	const Model& GetModel() const {
+		return model;
+	}
 
-	vec4	  varying_pos[3];
-	mat<2, 3> varying_uv;
-	mat<3, 3> varying_worldNormal;
-	mat<3, 3> varying_worldPos;
+	// Object to world transform used by the following ProcessVertices, one per model instance
+	void SetModelMatrix(const mat<4, 4>& matrix) {
+		modelMatrix = matrix;
+		normalMatrix = modelMatrix.invert_transpose();
+		mvpMatrix = viewProjMatrix * modelMatrix;
+	}
 
-public :
-	BlinnPhongShader(Renderer& renderer, Model& model) : Shader(renderer, model) {
-		renderer.GetTexture(model, "_main.tga", mainTexture);
-		renderer.GetTexture(model, "_spec.tga", specTexture);
+	// Vertex stage: transform each welded vertex of the given meshlets once per draw
+	void ProcessVertices(const std::vector<int>& meshlets) {
+		int nverts = model.GetNumberOfVertices();
+		if (!active) {
+			cache_clipPos = arena.Allocate<vec4>(nverts);
+			cache_worldPos = arena.Allocate<vec3>(nverts);
+			cache_worldNormal = arena.Allocate<vec3>(nverts);
+			activeVertices = arena.Allocate<int>(nverts);
+			active = arena.Allocate<std::uint8_t>(nverts);
+			std::fill(active, active + nverts, 0);
+		}
+
+		// Clear only the flags the previous instance set
+		for (int k = 0; k < activeCount; k++) active[activeVertices[k]] = 0;
+		activeCount = 0;
+		for (int m : meshlets) {
+			const Model::Meshlet& meshlet = model.GetMeshlet(m);
+			for (int k = 0; k < meshlet.vertexCount; k++) {
+				int i = model.GetMeshletVertex(meshlet.firstVertex + k);
+				if (active[i]) continue;
+				active[i] = 1;
+				activeVertices[activeCount++] = i;
+			}
+		}
+
+#pragma omp parallel for
+		for (int k = 0; k < activeCount; k++) {
+			int i = activeVertices[k];
+			const Model::Vertex& v = model.GetVertex(i);
+			vec4 pos = embed<4>(v.pos);
+			cache_clipPos[i] = mvpMatrix * pos;
+			cache_worldPos[i] = proj<3>(modelMatrix * pos);
+			cache_worldNormal[i] = proj<3>(normalMatrix * embed<4>(v.normal, 0.)).normalize();
+		}
 	}
 
-	void PreWork(const int iface, const int jvert) {
-		input_vertex = model.GetVert(iface, jvert);
-		input_normal = model.GetNormal(iface, jvert).normalize();
-		input_texcoord = model.GetTexcoord(iface, jvert);
+	// Primitive assembly: gather a face from the post-transform cache
+	void AssembleFace(const int iface, vec4 clipPos[3], Varyings& varyings) const {
+		for (int j = 0; j < 3; j++) {
+			int ivert = model.GetIndex(iface, j);
+			clipPos[j] = cache_clipPos[ivert];
+			varyings.uv.set_col(j, model.GetVertex(ivert).uv);
+			varyings.worldNormal.set_col(j, cache_worldNormal[ivert]);
+			varyings.worldPos.set_col(j, cache_worldPos[ivert]);
+		}
 	}
 
-	vec4 vertex(const int jvert) {
-		varying_pos[jvert] = mvpMatrix * embed<4>(input_vertex);
-		varying_uv.set_col(jvert, input_texcoord);
-		varying_worldNormal.set_col(jvert, proj<3>((modelMatrix).invert_transpose() * embed<4>(input_normal, 0.)).normalize());
-		varying_worldPos.set_col(jvert, proj<3>(modelMatrix * embed<4>(input_vertex)));
+	// Derived shaders provide the fragment stage as a non-virtual member, resolved at compile time
+	// by Renderer::Draw<ShaderT>:
+	//   bool fragment(const Varyings& varyings, vec3 bar, vec3 barDx, vec3 barDy, vec3& out_color) const;
+	// bar is perspective correct, barDx and barDy are its derivatives along screen x and y,
+	// returning true discards the fragment
+};
+
+class BlinnPhongShader : public Shader {
+	std::shared_ptr<const Texture> mainTexture;
+	std::shared_ptr<const Texture> specTexture;
 
-		return varying_pos[jvert];
+public :
+	BlinnPhongShader(Renderer& renderer, Model& model) : Shader(renderer, model) {
+		mainTexture = renderer.GetTexture(model, "_main.tga", TGAColor(255, 255, 255));
+		specTexture = renderer.GetTexture(model, "_spec.tga", TGAColor(0, 0, 0));
 	}
 
-	bool fragment(vec3 bar, vec3& out_color) {
-		vec2 uv = varying_uv * bar;
-		vec3 worldNormal = (varying_worldNormal * bar).normalize();
-		vec3 worldPos = varying_worldPos * bar;
+	bool fragment(const Varyings& varyings, vec3 bar, vec3 barDx, vec3 barDy, vec3& out_color) const {
+		vec2 uv = varyings.uv * bar;
+		vec2 uvDx = varyings.uv * barDx, uvDy = varyings.uv * barDy;
+		vec3 worldNormal = (varyings.worldNormal * bar).normalize();
+		vec3 worldPos = varyings.worldPos * bar;
 
 		vec3 viewDir = (cameraPos - worldPos).normalize();
 
-		const double ambLight = 10.0 / 255;
-		double diffuse = saturate(worldSpaceLightDir * worldNormal);
-		double specular = pow(std::max((viewDir + worldSpaceLightDir).normalize() * worldNormal, 0.0), 5 + tex2D(specTexture, uv)[2] * 255);
-		vec3 color = tex2D(mainTexture, uv);
-		out_color = saturate(color * (specular + diffuse) + vec3(1, 1, 1) * ambLight);
+		const float ambLight = 10.f / 255;
+		float diffuse = saturate(worldSpaceLightDir * worldNormal);
+		float specular = std::pow(std::max((viewDir + worldSpaceLightDir).normalize() * worldNormal, 0.f), 5 + tex2D(*specTexture, uv, uvDx, uvDy)[2] * 255);
+		float shadow = Shadow(worldPos, worldNormal);
+		vec3 color = tex2D(*mainTexture, uv, uvDx, uvDy);
+		out_color = saturate(color * ((specular + diffuse) * shadow) + vec3(1, 1, 1) * ambLight);
 
 		return false;
 	}
 };
 
 class BumpShader : public Shader {
-	TGAImage mainTexture;
-	TGAImage specTexture;
-	TGAImage normalTangentTexture;
-
-	vec3 input_vertex;
-	vec3 input_normal;
-	vec2 input_texcoord;
-
-	vec4	  varying_pos[3];
-	mat<2, 3> varying_uv;
-	mat<3, 3> varying_worldNormal;
-	mat<3, 3> varying_worldPos;
+	std::shared_ptr<const Texture> mainTexture;
+	std::shared_ptr<const Texture> specTexture;
+	std::shared_ptr<const Texture> normalTangentTexture;
 
 public:
 	BumpShader(Renderer& renderer, Model& model) : Shader(renderer, model) {
-		renderer.GetTexture(model, "_main.tga", mainTexture);
-		renderer.GetTexture(model, "_spec.tga", specTexture);
-		renderer.GetTexture(model, "_nm_tangent.tga", normalTangentTexture);
-	}
-
-	void PreWork(const int iface, const int jvert) {
-		input_vertex = model.GetVert(iface, jvert);
-		input_normal = model.GetNormal(iface, jvert).normalize();
-		input_texcoord = model.GetTexcoord(iface, jvert);
-	}
-
-	vec4 vertex(const int jvert) {
-		varying_pos[jvert] = mvpMatrix * embed<4>(input_vertex);
-		varying_uv.set_col(jvert, input_texcoord);
-		varying_worldNormal.set_col(jvert, proj<3>((modelMatrix).invert_transpose() * embed<4>(input_normal, 0.)).normalize());
-		varying_worldPos.set_col(jvert, proj<3>(modelMatrix * embed<4>(input_vertex)));
-
-		return varying_pos[jvert];
+		mainTexture = renderer.GetTexture(model, "_main.tga", TGAColor(255, 255, 255));
+		specTexture = renderer.GetTexture(model, "_spec.tga", TGAColor(0, 0, 0));
+		normalTangentTexture = renderer.GetTexture(model, "_nm_tangent.tga", TGAColor(128, 128, 255));
 	}
 
-	bool fragment(vec3 bar, vec3& out_color) {
-		vec2 uv = varying_uv * bar;
-		vec3 worldNormal = (varying_worldNormal * bar).normalize();
-		vec3 worldPos = varying_worldPos * bar;
+	bool fragment(const Varyings& varyings, vec3 bar, vec3 barDx, vec3 barDy, vec3& out_color) const {
+		vec2 uv = varyings.uv * bar;
+		vec2 uvDx = varyings.uv * barDx, uvDy = varyings.uv * barDy;
+		vec3 worldNormal = (varyings.worldNormal * bar).normalize();
+		vec3 worldPos = varyings.worldPos * bar;
 
-		mat<2, 2> tmpMat1 = mat<2, 2>{ { varying_uv.col(1) - varying_uv.col(0), varying_uv.col(2) - varying_uv.col(0) } }.invert();
-		mat<2, 3> tmpMat2 = mat<2, 3>{ { varying_worldPos.col(1) - varying_worldPos.col(0), varying_worldPos.col(2) - varying_worldPos.col(0) } };
+		mat<2, 2> tmpMat1 = mat<2, 2>{ { varyings.uv.col(1) - varyings.uv.col(0), varyings.uv.col(2) - varyings.uv.col(0) } }.invert();
+		mat<2, 3> tmpMat2 = mat<2, 3>{ { varyings.worldPos.col(1) - varyings.worldPos.col(0), varyings.worldPos.col(2) - varyings.worldPos.col(0) } };
 		mat<2, 3> TB = tmpMat1 * tmpMat2;
 		mat<3, 3> TBN = mat<3, 3>{ { TB[0].normalize(), TB[1].normalize(), worldNormal } };
 		TBN[0] = (TBN[0] - (worldNormal * TBN[0]) * worldNormal).normalize();
 		TBN[1] = cross(worldNormal, TBN[0]);
 
-		vec3 normal = (TBN.transpose() * PackNormal(normalTangentTexture, uv).normalize()).normalize();
+		vec3 normal = (TBN.transpose() * PackNormal(*normalTangentTexture, uv, uvDx, uvDy).normalize()).normalize();
 
 		vec3 viewDir = (cameraPos - worldPos).normalize();
 
-		const double ambLight = 10.0 / 255;
-		double diffuse = saturate(worldSpaceLightDir * normal);
-		double specular = pow(std::max((viewDir + worldSpaceLightDir).normalize() * normal, 0.0), 5 + tex2D(specTexture, uv)[2] * 255);
-		vec3 color = tex2D(mainTexture, uv);
-		out_color = saturate(color * (specular + diffuse) + vec3(1, 1, 1) * ambLight);
+		const float ambLight = 10.f / 255;
+		float diffuse = saturate(worldSpaceLightDir * normal);
+		float specular = std::pow(std::max((viewDir + worldSpaceLightDir).normalize() * normal, 0.f), 5 + tex2D(*specTexture, uv, uvDx, uvDy)[2] * 255);
+		float shadow = Shadow(worldPos, worldNormal);
+		vec3 color = tex2D(*mainTexture, uv, uvDx, uvDy);
+		out_color = saturate(color * ((specular + diffuse) * shadow) + vec3(1, 1, 1) * ambLight);
 
 		return false;
 	}
@@ -0,0 +1,153 @@
+#include <algorithm>
+#include <cmath>
+#include "shadowmap.h"
+#include "profiler.h"
+
+ShadowMap::ShadowMap(const int size) :
+	size(size),
+	depth(size, size, 1e10f),
+	texelSize(0)
+{
+	bands.resize((size + BAND_HEIGHT - 1) / BAND_HEIGHT);
+}
+
+void ShadowMap::Begin(const vec3 lightDir, const vec3 center, const float radius) {
+	vec3 z = lightDir;
+	z.normalize();
+	vec3 up = std::abs(z.y) < 0.99f ? vec3(0, 1, 0) : vec3(1, 0, 0);
+	vec3 x = cross(up, z).normalize();
+	vec3 y = cross(z, x);
+
+	// [-radius, radius] across the light maps onto the texels, depth grows away from the light
+	float scale = size / (2 * radius);
+	this->lightDir = z;
+	texelSize = 1 / scale;
+	lightMatrix = { {
+		{ x.x * scale, x.y * scale, x.z * scale, -(x * center) * scale + size / 2.f },
+		{ y.x * scale, y.y * scale, y.z * scale, -(y * center) * scale + size / 2.f },
+		{ -z.x, -z.y, -z.z, z * center + radius },
+		{ 0, 0, 0, 1 }
+	} };
+	depth.Fill(1e10f);
+}
+
+void ShadowMap::Draw(const Model& model, const mat<4, 4>& modelMatrix) {
+	mat<4, 4> m = lightMatrix * modelMatrix;
+	int nverts = model.GetNumberOfVertices();
+	lightSpacePos.resize(nverts);
+#pragma omp parallel for
+	for (int i = 0; i < nverts; i++) {
+		lightSpacePos[i] = proj<3>(m * embed<4>(model.GetVertex(i).pos));
+	}
+
+	// Both windings are drawn, so open meshes still cast shadows
+	triangles.clear();
+	for (auto& band : bands) band.clear();
+	int nfaces = model.GetNumberOfFaces();
+	for (int i = 0; i < nfaces; i++) {
+		vec3 v[3];
+		for (int j = 0; j < 3; j++) v[j] = lightSpacePos[model.GetIndex(i, j)];
+		DepthTriangle tri;
+		if (!SetupTriangle(v, tri)) continue;
+		for (int b = tri.ymin / BAND_HEIGHT; b <= tri.ymax / BAND_HEIGHT; b++) bands[b].push_back((int)triangles.size());
+		triangles.push_back(tri);
+	}
+
+#pragma omp parallel for schedule(dynamic)
+	for (int b = 0; b < (int)bands.size(); b++) {
+		QS_PROFILE_SCOPE("shadow band");
+		RasterizeBand(b);
+	}
+}
+
+bool ShadowMap::SetupTriangle(const vec3 v[3], DepthTriangle& tri) const {
+	long long X[3], Y[3];
+	for (int j = 0; j < 3; j++) {
+		if (!(std::abs(v[j].x) < 4 * size && std::abs(v[j].y) < 4 * size)) return false;
+		X[j] = std::llround(v[j].x * (1 << SUBPIXEL_BITS));
+		Y[j] = std::llround(v[j].y * (1 << SUBPIXEL_BITS));
+	}
+	long long area2 = (X[1] - X[0]) * (Y[2] - Y[0]) - (X[2] - X[0]) * (Y[1] - Y[0]);
+	if (area2 == 0) return false;
+
+	const long long one = 1LL << SUBPIXEL_BITS;
+	long long minX = std::min({ X[0], X[1], X[2] }), maxX = std::max({ X[0], X[1], X[2] });
+	long long minY = std::min({ Y[0], Y[1], Y[2] }), maxY = std::max({ Y[0], Y[1], Y[2] });
+	tri.xmin = (int)std::max((minX + one - 1) >> SUBPIXEL_BITS, 0LL);
+	tri.ymin = (int)std::max((minY + one - 1) >> SUBPIXEL_BITS, 0LL);
+	tri.xmax = (int)std::min(maxX >> SUBPIXEL_BITS, size - 1LL);
+	tri.ymax = (int)std::min(maxY >> SUBPIXEL_BITS, size - 1LL);
+	if (tri.xmin > tri.xmax || tri.ymin > tri.ymax) return false;
+
+	long long winding = area2 > 0 ? 1 : -1;
+	area2 *= winding;
+	double zA = 0, zB = 0, zC = 0;
+	for (int i = 0; i < 3; i++) {
+		int j = (i + 1) % 3, k = (i + 2) % 3;
+		long long dx = (X[k] - X[j]) * winding, dy = (Y[k] - Y[j]) * winding;
+		tri.edgeA[i] = -dy;
+		tri.edgeB[i] = dx;
+		tri.edgeC[i] = dy * X[j] - dx * Y[j];
+		bool topLeft = dy < 0 || (dy == 0 && dx < 0);
+		if (!topLeft) tri.edgeC[i] -= 1;
+
+		// The projection is orthographic, depth is linear in texel space
+		double w = v[i].z / area2;
+		zA += tri.edgeA[i] * w;
+		zB += tri.edgeB[i] * w;
+		zC += tri.edgeC[i] * w;
+	}
+	tri.z0 = (float)zC;
+	tri.zDx = (float)(zA * one);
+	tri.zDy = (float)(zB * one);
+	return true;
+}
+
+void ShadowMap::RasterizeBand(const int band) {
+	int y0 = band * BAND_HEIGHT, y1 = std::min(y0 + BAND_HEIGHT, size) - 1;
+	for (int idx : bands[band]) {
+		const DepthTriangle& tri = triangles[idx];
+		int ymin = std::max(tri.ymin, y0), ymax = std::min(tri.ymax, y1);
+		for (int y = ymin; y <= ymax; y++) {
+			long long e[3], stepX[3];
+			for (int i = 0; i < 3; i++) {
+				e[i] = tri.edgeA[i] * ((long long)tri.xmin << SUBPIXEL_BITS) + tri.edgeB[i] * ((long long)y << SUBPIXEL_BITS) + tri.edgeC[i];
+				stepX[i] = tri.edgeA[i] * (1LL << SUBPIXEL_BITS);
+			}
+			float z = tri.z0 + tri.zDx * tri.xmin + tri.zDy * y;
+			float* row = depth.GetRow(y);
+			for (int x = tri.xmin; x <= tri.xmax; x++) {
+				if ((e[0] | e[1] | e[2]) >= 0 && z < row[x]) row[x] = z;
+				e[0] += stepX[0];
+				e[1] += stepX[1];
+				e[2] += stepX[2];
+				z += tri.zDx;
+			}
+		}
+	}
+}
+
+float ShadowMap::Visibility(const vec3& worldPos, const vec3& worldNormal) const {
+	vec3 p = proj<3>(lightMatrix * embed<4>(worldPos + worldNormal * (1.5f * texelSize)));
+	float receiver = p.z - texelSize;
+
+	// Taps at -1..2 around the texel below p with weights (1 - f, 1, 1, f) per axis,
+	// a tent filter centered on p
+	int bx = (int)std::floor(p.x), by = (int)std::floor(p.y);
+	float fx = p.x - bx, fy = p.y - by;
+	const float wx[4] = { 1 - fx, 1, 1, fx }, wy[4] = { 1 - fy, 1, 1, fy };
+	float lit = 0;
+	for (int j = 0; j < 4; j++) {
+		int y = std::min(std::max(by - 1 + j, 0), size - 1);
+		const float* row = depth.GetRow(y);
+		for (int i = 0; i < 4; i++) {
+			int x = std::min(std::max(bx - 1 + i, 0), size - 1);
+			if (receiver <= row[x]) lit += wx[i] * wy[j];
+		}
+	}
+	return lit / 9;
+}
+
+int ShadowMap::GetSize() const {
+	return size;
+}
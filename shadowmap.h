@@ -0,0 +1,49 @@
+#pragma once
+
+#include <vector>
+#include "geometry.h"
+#include "buffer.h"
+#include "model.h"
+
+// Depth of the scene seen from a directional light through an orthographic projection that
+// encloses the scene's bounding sphere. Rendering is depth only: positions are the only vertex
+// attribute and no shader runs
+class ShadowMap {
+	static const int SUBPIXEL_BITS = 8;
+	// Rows of texels per band, each worker rasterizes whole bands
+	static const int BAND_HEIGHT = 16;
+
+	// Edge functions like the main rasterizer's, plus a depth plane over texel coordinates
+	struct DepthTriangle {
+		long long edgeA[3], edgeB[3], edgeC[3];
+		float z0, zDx, zDy;
+		int xmin, ymin, xmax, ymax;
+	};
+
+	int size;
+	Buffer<float> depth;
+	// World space to (texel x, texel y, distance from the light's near plane)
+	mat<4, 4> lightMatrix;
+	vec3 lightDir;
+	float texelSize;
+
+	std::vector<vec3> lightSpacePos;
+	std::vector<DepthTriangle> triangles;
+	std::vector<std::vector<int>> bands;
+
+	bool SetupTriangle(const vec3 v[3], DepthTriangle&) const;
+	void RasterizeBand(const int band);
+
+public :
+	explicit ShadowMap(const int size = 2048);
+
+	// Clear the map and aim it along lightDir (pointing towards the light) at the sphere
+	void Begin(const vec3 lightDir, const vec3 center, const float radius);
+	void Draw(const Model&, const mat<4, 4>& modelMatrix);
+
+	// Fraction of the light reaching a point, 3x3 bilinear PCF. The point is pushed along its
+	// normal by about a texel against self-shadowing
+	float Visibility(const vec3& worldPos, const vec3& worldNormal) const;
+
+	int GetSize() const;
+};
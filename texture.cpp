@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <cmath>
+#include "texture.h"
+
+static std::uint32_t PackRGBA(const int r, const int g, const int b, const int a) {
+	return std::uint32_t(r) | std::uint32_t(g) << 8 | std::uint32_t(b) << 16 | std::uint32_t(a) << 24;
+}
+
+static vec4 UnpackRGBA(const std::uint32_t texel) {
+	return vec4(float(texel & 0xff), float(texel >> 8 & 0xff), float(texel >> 16 & 0xff), float(texel >> 24));
+}
+
+// Position of texel (x, y) inside a 4x4 tile, interleaving the bits of x and y
+static int MortonIndex(const int x, const int y) {
+	return (x & 1) | (y & 1) << 1 | (x & 2) << 1 | (y & 2) << 2;
+}
+
+Texture::Level::Level(const int width, const int height) :
+	width(width),
+	height(height),
+	tilesX((width + TILE_SIZE - 1) >> TILE_SHIFT),
+	tiles(tilesX * ((height + TILE_SIZE - 1) >> TILE_SHIFT))
+{
+}
+
+std::uint32_t Texture::Level::Fetch(const int x, const int y) const {
+	const Tile& tile = tiles[(y >> TILE_SHIFT) * tilesX + (x >> TILE_SHIFT)];
+	return tile.texels[MortonIndex(x & (TILE_SIZE - 1), y & (TILE_SIZE - 1))];
+}
+
+void Texture::Level::Store(const int x, const int y, const std::uint32_t texel) {
+	Tile& tile = tiles[(y >> TILE_SHIFT) * tilesX + (x >> TILE_SHIFT)];
+	tile.texels[MortonIndex(x & (TILE_SIZE - 1), y & (TILE_SIZE - 1))] = texel;
+}
+
+Texture::Texture(const TGAImage& image) {
+	levels.emplace_back(std::max(image.width(), 1), std::max(image.height(), 1));
+	Level& base = levels[0];
+	for (int y = 0; y < image.height(); y++) {
+		for (int x = 0; x < image.width(); x++) {
+			TGAColor c = image.get(x, y);
+			// Grayscale images only fill the first channel
+			if (c.bytespp == 1) base.Store(x, y, PackRGBA(c[0], c[0], c[0], 255));
+			else base.Store(x, y, PackRGBA(c[2], c[1], c[0], c.bytespp == 4 ? c[3] : 255));
+		}
+	}
+	BuildMipChain();
+}
+
+// Each level halves the previous one with a 2x2 box filter, an odd last row or column is dropped
+void Texture::BuildMipChain() {
+	while (levels.back().width > 1 || levels.back().height > 1) {
+		const Level& src = levels.back();
+		Level dst(std::max(src.width / 2, 1), std::max(src.height / 2, 1));
+		for (int y = 0; y < dst.height; y++) {
+			int y0 = std::min(2 * y, src.height - 1), y1 = std::min(2 * y + 1, src.height - 1);
+			for (int x = 0; x < dst.width; x++) {
+				int x0 = std::min(2 * x, src.width - 1), x1 = std::min(2 * x + 1, src.width - 1);
+				std::uint32_t t[4] = { src.Fetch(x0, y0), src.Fetch(x1, y0), src.Fetch(x0, y1), src.Fetch(x1, y1) };
+				int sum[4] = {};
+				for (int k = 0; k < 4; k++) {
+					for (int c = 0; c < 4; c++) sum[c] += t[k] >> (c * 8) & 0xff;
+				}
+				dst.Store(x, y, PackRGBA((sum[0] + 2) >> 2, (sum[1] + 2) >> 2, (sum[2] + 2) >> 2, (sum[3] + 2) >> 2));
+			}
+		}
+		levels.push_back(std::move(dst));
+	}
+}
+
+int Texture::GetWidth() const {
+	return levels[0].width;
+}
+
+int Texture::GetHeight() const {
+	return levels[0].height;
+}
+
+int Texture::GetNumberOfLevels() const {
+	return (int)levels.size();
+}
+
+vec4 Texture::SampleBilinear(const Level& level, vec2 uv) const {
+	float fx = uv.x * level.width - 0.5f, fy = uv.y * level.height - 0.5f;
+	float flx = std::floor(fx), fly = std::floor(fy);
+	float tx = fx - flx, ty = fy - fly;
+	int x0 = (int)flx, y0 = (int)fly;
+	int x1 = std::min(std::max(x0 + 1, 0), level.width - 1), y1 = std::min(std::max(y0 + 1, 0), level.height - 1);
+	x0 = std::min(std::max(x0, 0), level.width - 1);
+	y0 = std::min(std::max(y0, 0), level.height - 1);
+
+	vec4 top = UnpackRGBA(level.Fetch(x0, y0)) * (1 - tx) + UnpackRGBA(level.Fetch(x1, y0)) * tx;
+	vec4 bottom = UnpackRGBA(level.Fetch(x0, y1)) * (1 - tx) + UnpackRGBA(level.Fetch(x1, y1)) * tx;
+	return (top * (1 - ty) + bottom * ty) / 255.f;
+}
+
+vec4 Texture::SamplePoint(vec2 uv) const {
+	const Level& base = levels[0];
+	int x = std::min(std::max((int)(uv.x * base.width), 0), base.width - 1);
+	int y = std::min(std::max((int)(uv.y * base.height), 0), base.height - 1);
+	return UnpackRGBA(base.Fetch(x, y)) / 255.f;
+}
+
+vec4 Texture::SampleLevel(vec2 uv, float lod) const {
+	int maxLevel = (int)levels.size() - 1;
+	if (!(lod > 0)) return SampleBilinear(levels[0], uv);
+	if (lod >= maxLevel) return SampleBilinear(levels[maxLevel], uv);
+	int level = (int)lod;
+	float t = lod - level;
+	vec4 a = SampleBilinear(levels[level], uv);
+	if (t == 0) return a;
+	return a * (1 - t) + SampleBilinear(levels[level + 1], uv) * t;
+}
+
+vec4 Texture::Sample(vec2 uv, vec2 ddx, vec2 ddy) const {
+	vec2 size((float)levels[0].width, (float)levels[0].height);
+	vec2 dx(ddx.x * size.x, ddx.y * size.y), dy(ddy.x * size.x, ddy.y * size.y);
+	float rho2 = std::max(dx * dx, dy * dy);
+	// log2 of the longer texel footprint axis
+	return SampleLevel(uv, 0.5f * std::log2(rho2));
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "geometry.h"
+#include "tgaimage.h"
+
+// Sampler-side copy of a TGAImage: RGBA8 texels in 4x4 tiles of one 64-byte cache line each,
+// Morton ordered inside the tile, with a full box-filtered mip chain built at load time.
+// Addressing clamps to the edge, uv (0, 0) is texel (0, 0) of the source image.
+class Texture {
+	static const int TILE_SHIFT = 2;
+	static const int TILE_SIZE = 1 << TILE_SHIFT;
+
+	struct alignas(64) Tile {
+		std::uint32_t texels[TILE_SIZE * TILE_SIZE];
+	};
+
+	struct Level {
+		int width, height;
+		int tilesX;
+		std::vector<Tile> tiles;
+
+		Level(const int width, const int height);
+
+		std::uint32_t Fetch(const int x, const int y) const;
+		void Store(const int x, const int y, const std::uint32_t texel);
+	};
+
+	std::vector<Level> levels;
+
+	void BuildMipChain();
+	vec4 SampleBilinear(const Level&, vec2 uv) const;
+
+public :
+	explicit Texture(const TGAImage& image);
+
+	int GetWidth() const;
+	int GetHeight() const;
+	int GetNumberOfLevels() const;
+
+	// Nearest texel of the base level
+	vec4 SamplePoint(vec2 uv) const;
+	// Trilinear filtering between the two mip levels around lod
+	vec4 SampleLevel(vec2 uv, float lod) const;
+	// Trilinear filtering with the LOD taken from the screen-space uv derivatives
+	vec4 Sample(vec2 uv, vec2 ddx, vec2 ddy) const;
+};
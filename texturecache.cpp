@@ -0,0 +1,29 @@
+#include <iostream>
+#include "texturecache.h"
+#include "profiler.h"
+
+std::shared_ptr<TextureCache::Entry> TextureCache::GetEntry(const std::string& path) {
+	std::lock_guard<std::mutex> lock(entriesMutex);
+	std::shared_ptr<Entry>& entry = entries[path];
+	if (!entry) entry = std::make_shared<Entry>();
+	return entry;
+}
+
+std::shared_ptr<const Texture> TextureCache::Get(const std::string& path) {
+	std::shared_ptr<Entry> entry = GetEntry(path);
+	std::call_once(entry->loaded, [&]() {
+		QS_PROFILE_SCOPE("load texture");
+		TGAImage image;
+		bool ok = image.read_tga_file(path);
+		if (ok) entry->texture = std::make_shared<Texture>(image);
+		else std::cerr << "error: texture file " << path << " loading failed" << std::endl;
+	});
+	return entry->texture;
+}
+
+void TextureCache::Preload(const std::vector<std::string>& paths) {
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < (int)paths.size(); i++) {
+		Get(paths[i]);
+	}
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "texture.h"
+
+// Textures keyed by path, each file is read and converted once and shared by every user
+class TextureCache {
+	struct Entry {
+		std::once_flag loaded;
+		std::shared_ptr<const Texture> texture;
+	};
+
+	std::map<std::string, std::shared_ptr<Entry>> entries;
+	std::mutex entriesMutex;
+
+	std::shared_ptr<Entry> GetEntry(const std::string& path);
+
+public :
+	// Thread safe, concurrent requests for the same path wait for a single load.
+	// Returns nullptr when the file can't be read, the error is reported once
+	std::shared_ptr<const Texture> Get(const std::string& path);
+	// Load several files in parallel ahead of use
+	void Preload(const std::vector<std::string>& paths);
+};